@@ -0,0 +1,847 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+#include "cpu.h"
+#include "object.h"
+#include "symbols.h"
+
+class AssembleError : public std::runtime_error {
+
+ public:
+  AssembleError(const std::string& message, size_t line_number)
+      : std::runtime_error(message), line_number(line_number) {
+  }
+
+  size_t get_line_number() const {
+    return line_number;
+  }
+
+ private:
+  size_t line_number;
+};
+
+
+// Splits the program into tokens that point into the source buffer; the buffer must outlive them
+class Tokenizer {
+
+ public:
+  explicit Tokenizer(std::string_view s, size_t first_line = 0)
+      : data(s), line_number(first_line) {
+  };
+
+  std::string_view get_token() {
+    skip_whitespace();
+    if (position >= data.size()) {
+      // The last line gets its newline even if the file does not end with one
+      if (at_line_start) {
+        return "";
+      }
+      at_line_start = true;
+      ++line_number;
+      return "\n";
+    }
+    return read_token();
+  }
+
+  size_t get_line_number() const {
+    return line_number;
+  }
+
+ private:
+
+  void skip_whitespace() {
+    while (position < data.size() && (data[position] == ' ' || data[position] == '\t')) {
+      ++position;
+    }
+    if (position < data.size() && data[position] == ';') {
+      while (position < data.size() && data[position] != '\n') {
+        ++position;
+      }
+    }
+  }
+
+  std::string_view read_token() {
+    if (data[position] == '\n') {
+      ++position;
+      ++line_number;
+      at_line_start = true;
+      return "\n";
+    }
+    size_t start = position;
+    if (data[position] == '"') {
+      // A string runs to the closing quote, spaces and semicolons included
+      ++position;
+      while (position < data.size() && data[position] != '"' && data[position] != '\n') {
+        position += data[position] == '\\' && position + 1 < data.size() && data[position + 1] != '\n' ? 2 : 1;
+      }
+      position += position < data.size() && data[position] == '"';
+      at_line_start = false;
+      return data.substr(start, position - start);
+    }
+    while (position < data.size() && data[position] != ' ' && data[position] != '\t' && data[position] != '\n') {
+      ++position;
+    }
+    at_line_start = false;
+    return data.substr(start, position - start);
+  }
+
+  std::string_view data;
+  size_t position{0};
+  size_t line_number{0};
+  bool at_line_start{true};
+};
+
+[[noreturn]] inline void error(const std::string& error, size_t line_no) {
+  throw AssembleError(error, line_no);
+}
+
+inline uint32_t hash_name(std::string_view name, uint32_t seed = 0) {
+  // FNV-1a with a final mix, so that the low bits used for the slot depend on the whole state
+  uint32_t hash = 2166136261u ^ seed;
+  for (char c : name) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+  }
+  hash ^= hash >> 16;
+  hash *= 0x45d9f3bu;
+  return hash ^ (hash >> 16);
+}
+
+
+// Collision-free table of mnemonics; CPU::commands is built at runtime, so the seed is searched for
+// once at startup
+class MnemonicTable {
+
+ public:
+  MnemonicTable() {
+    while (slots.size() < 4 * CPU::commands.size()) {
+      slots.resize(slots.empty() ? 1 : 2 * slots.size());
+    }
+    while (!try_seed()) {
+      ++seed;
+    }
+  }
+
+  int find(std::string_view name) const {
+    uint16_t slot = slots[hash_name(name, seed) & (slots.size() - 1)];
+    if (slot && CPU::commands[slot - 1].mnemonic == name) {
+      return slot - 1;
+    }
+    return -1;
+  }
+
+ private:
+  bool try_seed() {
+    std::fill(slots.begin(), slots.end(), 0);
+    for (size_t i = 0; i < CPU::commands.size(); ++i) {
+      uint16_t& slot = slots[hash_name(CPU::commands[i].mnemonic, seed) & (slots.size() - 1)];
+      if (slot) {
+        return false;
+      }
+      slot = static_cast<uint16_t>(i + 1);
+    }
+    return true;
+  }
+
+  std::vector<uint16_t> slots{};
+  uint32_t seed{0};
+};
+
+
+// Open-addressing label table with linear probing; keys point into the source buffer
+class LabelTable {
+
+ public:
+  const uint32_t* find(std::string_view name) const {
+    if (slots.empty()) {
+      return nullptr;
+    }
+    const Slot& slot = slots[probe(name)];
+    return slot.used ? &slot.value : nullptr;
+  }
+
+  template<typename F>
+  void for_each(F f) const {
+    for (const auto& slot : slots) {
+      if (slot.used) {
+        f(slot.name, slot.value);
+      }
+    }
+  }
+
+  void insert(std::string_view name, uint32_t value) {
+    if (2 * (count + 1) > slots.size()) {
+      grow();
+    }
+    Slot& slot = slots[probe(name)];
+    if (!slot.used) {
+      ++count;
+    }
+    slot = {name, value, true};
+  }
+
+ private:
+  struct Slot {
+    std::string_view name{};
+    uint32_t value{0};
+    bool used{false};
+  };
+
+  size_t probe(std::string_view name) const {
+    size_t mask = slots.size() - 1;
+    size_t index = hash_name(name) & mask;
+    while (slots[index].used && slots[index].name != name) {
+      index = (index + 1) & mask;
+    }
+    return index;
+  }
+
+  void grow() {
+    std::vector<Slot> old(slots.empty() ? 64 : 2 * slots.size());
+    old.swap(slots);
+    for (const auto& slot : old) {
+      if (slot.used) {
+        slots[probe(slot.name)] = slot;
+      }
+    }
+  }
+
+  std::vector<Slot> slots{};
+  size_t count{0};
+};
+
+
+inline bool parse_number(std::string_view s, uint32_t& value) {
+  if (s.empty() || s.size() > 3) {
+    return false;
+  }
+  value = 0;
+  for (char c : s) {
+    if (!isdigit(c)) {
+      return false;
+    }
+    value = value * 10 + static_cast<uint32_t>(c - '0');
+  }
+  return true;
+}
+
+inline uint8_t get_command(std::string_view name, size_t line_number) {
+  static const MnemonicTable mnemonics;
+  int index = mnemonics.find(name);
+  if (index < 0) {
+    error("Invalid command: " + std::string(name), line_number);
+  }
+  return static_cast<uint8_t>(index);
+}
+
+inline uint8_t get_register(std::string_view name, size_t line_number) {
+  if (name == "RI") {
+    return REG_INSTRUCTION;
+  }
+  if (name == "RS") {
+    return REG_STACK;
+  }
+  uint32_t num{0};
+  if (name.empty() || name[0] != 'R' || !parse_number(name.substr(1), num) || num >= 256) {
+    error("Invalid register name: " + std::string(name), line_number);
+  }
+  return static_cast<uint8_t>(num);
+}
+
+inline uint8_t get_vector_register(std::string_view name, size_t line_number) {
+  uint32_t num{0};
+  if (name.empty() || name[0] != 'V' || !parse_number(name.substr(1), num) || num >= VECTOR_REGISTERS) {
+    error("Invalid vector register name: " + std::string(name), line_number);
+  }
+  return static_cast<uint8_t>(num);
+}
+
+inline void push_uint32(std::vector<uint8_t>& vec, uint32_t num) {
+  vec.push_back(static_cast<uint8_t>(num));
+  vec.push_back(static_cast<uint8_t>(num >> 8));
+  vec.push_back(static_cast<uint8_t>(num >> 16));
+  vec.push_back(static_cast<uint8_t>(num >> 24));
+}
+
+inline void write_uint32(std::vector<uint8_t>& vec, size_t position, uint32_t num) {
+  vec[position] = static_cast<uint8_t>(num);
+  vec[position + 1] = static_cast<uint8_t>(num >> 8);
+  vec[position + 2] = static_cast<uint8_t>(num >> 16);
+  vec[position + 3] = static_cast<uint8_t>(num >> 24);
+}
+
+
+// A 32-bit operand: a number or a reference to a label
+struct Operand {
+  std::string_view label{};
+  uint32_t value{0};
+
+  bool is_label() const {
+    return !label.empty();
+  }
+};
+
+// BYTE and WORD hold one value each, so `.byte 1 2 3` is three statements
+enum class statement_kind {
+  INSTRUCTION, LABEL, GLOBAL, BYTE, WORD, STRING, ZERO, ALIGN
+};
+
+// One meaningful source line, or one value of a data directive
+struct Statement {
+  statement_kind kind{statement_kind::INSTRUCTION};
+  section_kind section{section_kind::CODE};
+  uint8_t command{0};
+  std::array<uint8_t, 3> registers{{0, 0, 0}};
+  Operand operand{};
+  // Label declared or exported by the line, or the quoted text of a string
+  std::string_view name{};
+  size_t line_number{0};
+
+  const Command& get_command() const {
+    return CPU::commands[command];
+  }
+};
+
+inline size_t register_count(command_type type) {
+  switch (type) {
+    case command_type::REG:
+    case command_type::REGVAL:
+    case command_type::REGVAL8:
+    case command_type::REGVAL16:
+      return 1;
+    case command_type::REGREG:
+    case command_type::VECVEC:
+    case command_type::VECREG:
+    case command_type::REGVEC:
+      return 2;
+    case command_type::REGREGREG:
+      return 3;
+    case command_type::SIMPLE:
+    case command_type::LABEL:
+    case command_type::LABEL8:
+    case command_type::LABEL16:;
+  }
+  return 0;
+}
+
+// Size of the encoded operand in bytes
+inline size_t operand_size(command_type type) {
+  switch (type) {
+    case command_type::REGVAL:
+    case command_type::LABEL:
+      return 4;
+    case command_type::REGVAL16:
+    case command_type::LABEL16:
+      return 2;
+    case command_type::REGVAL8:
+    case command_type::LABEL8:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+inline bool has_operand(command_type type) {
+  return operand_size(type) != 0;
+}
+
+// LABEL8/16 operands are encoded relative to the end of the instruction
+inline bool is_relative(command_type type) {
+  return type == command_type::LABEL8 || type == command_type::LABEL16;
+}
+
+inline size_t instruction_size(const Command& command) {
+  return 1 + register_count(command.type) + operand_size(command.type);
+}
+
+inline Operand parse_operand(std::string_view value, size_t line_number) {
+  Operand operand;
+  if (value[0] == '@') {
+    operand.label = value;
+    return operand;
+  }
+  long long val{0};
+  const char* begin = value.data() + (value[0] == '+');
+  auto res = std::from_chars(begin, value.data() + value.size(), val);
+  if (res.ec != std::errc() || res.ptr == begin) {
+    error("Invalid number: " + std::string(value), line_number);
+  }
+  operand.value = static_cast<uint32_t>(val);
+  return operand;
+}
+
+inline uint8_t parse_register(command_type type, size_t index, std::string_view name, size_t line_number) {
+  bool vector = (type == command_type::VECVEC) || (type == command_type::VECREG && index == 0) ||
+                (type == command_type::REGVEC && index == 1);
+  return vector ? get_vector_register(name, line_number) : get_register(name, line_number);
+}
+
+inline void parse_directive(const std::vector<std::string_view>& line, Statement statement, section_kind& section,
+                            std::vector<Statement>& statements) {
+  std::string_view directive = line[0];
+  size_t values = line.size() - 2;
+  if (directive == ".code" || directive == ".rodata" || directive == ".data") {
+    if (values != 0) {
+      error("Syntax error", statement.line_number);
+    }
+    section = directive == ".code" ? section_kind::CODE
+                                   : directive == ".rodata" ? section_kind::RODATA : section_kind::DATA;
+    return;
+  }
+  if (directive == ".global") {
+    if (values != 1 || line[1][0] != '@') {
+      error("Syntax error", statement.line_number);
+    }
+    statement.kind = statement_kind::GLOBAL;
+    statement.name = line[1];
+    statements.push_back(statement);
+    return;
+  }
+  if (directive == ".byte" || directive == ".word") {
+    statement.kind = directive == ".byte" ? statement_kind::BYTE : statement_kind::WORD;
+  } else if (directive == ".string") {
+    statement.kind = statement_kind::STRING;
+  } else if (directive == ".zero") {
+    statement.kind = statement_kind::ZERO;
+  } else if (directive == ".align") {
+    statement.kind = statement_kind::ALIGN;
+  } else {
+    error("Invalid directive: " + std::string(directive), statement.line_number);
+  }
+  if (section == section_kind::CODE) {
+    error("Data outside of a data section", statement.line_number);
+  }
+  bool list = statement.kind == statement_kind::BYTE || statement.kind == statement_kind::WORD;
+  if (values == 0 || (!list && values != 1)) {
+    error("Syntax error", statement.line_number);
+  }
+  for (size_t i = 1; i <= values; ++i) {
+    if (statement.kind == statement_kind::STRING) {
+      if (line[i].size() < 2 || line[i].front() != '"' || line[i].back() != '"') {
+        error("Invalid string: " + std::string(line[i]), statement.line_number);
+      }
+      statement.name = line[i];
+    } else {
+      statement.operand = parse_operand(line[i], statement.line_number);
+      if (statement.operand.is_label() && statement.kind != statement_kind::WORD) {
+        error("Label not allowed here: " + std::string(line[i]), statement.line_number);
+      }
+    }
+    statements.push_back(statement);
+  }
+}
+
+// Reads the whole program once; the statements point into `program`. A piece of a larger source starts
+// in the section in effect where it was cut, after `first_line` lines.
+inline std::vector<Statement> parse(std::string_view program, section_kind section = section_kind::CODE,
+                                    size_t first_line = 0) {
+  Tokenizer tokenizer(program, first_line);
+  std::vector<Statement> statements;
+  std::vector<std::string_view> line{};
+  while (true) {
+    line.clear();
+    do {
+      line.push_back(tokenizer.get_token());
+    } while (!line.back().empty() && line.back() != "\n");
+    if (line.front().empty()) {
+      break;
+    }
+    if (line.size() == 1) {
+      continue;
+    }
+    Statement statement;
+    statement.line_number = tokenizer.get_line_number();
+    statement.section = section;
+    if (line[0][0] == '@') {
+      if (line.size() > 2) {
+        error("Invalid label declaration", statement.line_number);
+      }
+      statement.kind = statement_kind::LABEL;
+      statement.name = line[0];
+    } else if (line[0][0] == '.') {
+      parse_directive(line, statement, section, statements);
+      continue;
+    } else {
+      if (section != section_kind::CODE) {
+        error("Instruction outside of the code section", statement.line_number);
+      }
+      statement.command = get_command(line[0], statement.line_number);
+      command_type type = statement.get_command().type;
+      size_t registers = register_count(type);
+      if (line.size() != registers + has_operand(type) + 2) {
+        error("Syntax error", statement.line_number);
+      }
+      for (size_t i = 0; i < registers; ++i) {
+        statement.registers[i] = parse_register(type, i, line[i + 1], statement.line_number);
+      }
+      if (has_operand(type)) {
+        statement.operand = parse_operand(line[registers + 1], statement.line_number);
+      }
+    }
+    statements.push_back(statement);
+  }
+  return statements;
+}
+
+
+// A reference to a label not declared yet, patched once all statements are encoded
+// (or to any label when assembling an object file, where a 32-bit absolute one becomes a relocation)
+struct Fixup {
+  size_t position;
+  std::string_view label;
+  size_t line_number;
+  command_type type;
+  section_kind section;
+};
+
+inline bool fits_operand(int64_t value, size_t size) {
+  return size >= 4 || (value >= -(int64_t{1} << (8 * size - 1)) && value < (int64_t{1} << (8 * size - 1)));
+}
+
+// Value stored for an operand found at `position`, of which the low operand_size(type) bytes are written;
+// LABEL8/16 targets become offsets from the end of the instruction
+inline uint32_t encode_operand(size_t position, command_type type, uint32_t value, size_t line_number) {
+  size_t size = operand_size(type);
+  if (size == 4) {
+    return value;
+  }
+  int64_t encoded = is_relative(type) ? static_cast<int64_t>(value) - static_cast<int64_t>(position + size)
+                                      : static_cast<int32_t>(value);
+  if (!fits_operand(encoded, size)) {
+    error("Operand out of range", line_number);
+  }
+  return static_cast<uint32_t>(encoded);
+}
+
+inline void write_operand(std::vector<uint8_t>& vec, size_t position, command_type type, uint32_t value,
+                          size_t line_number) {
+  uint32_t encoded = encode_operand(position, type, value, line_number);
+  for (size_t i = 0; i < operand_size(type); ++i) {
+    vec[position + i] = static_cast<uint8_t>(encoded >> (8 * i));
+  }
+}
+
+// The 8 and 16-bit forms of every command with a 32-bit operand, 0 if it has none
+struct CompactForms {
+  uint8_t byte{0};
+  uint8_t word{0};
+};
+
+inline const std::vector<CompactForms>& compact_forms() {
+  static const std::vector<CompactForms> forms = [] {
+    std::vector<CompactForms> res(CPU::commands.size());
+    for (size_t i = 0; i < CPU::commands.size(); ++i) {
+      for (size_t j = 0; j < CPU::commands.size(); ++j) {
+        if (CPU::commands[j].mnemonic == CPU::commands[i].mnemonic + ".b") {
+          res[i].byte = static_cast<uint8_t>(j);
+        } else if (CPU::commands[j].mnemonic == CPU::commands[i].mnemonic + ".w") {
+          res[i].word = static_cast<uint8_t>(j);
+        }
+      }
+    }
+    return res;
+  }();
+  return forms;
+}
+
+// Replaces commands with a 32-bit operand by their shortest form. Numbers are sized directly; label
+// operands start at 8 bits and are relaxed to a larger form while their offset does not fit, which ends
+// because forms only grow. Data labels, whose addresses are only known at the end, and label addresses in
+// object files keep 32-bit operands, since relocations are 32-bit; jumps within an object are shortened.
+inline void select_compact_forms(std::vector<Statement>& statements, bool object) {
+  const auto& forms = compact_forms();
+  LabelTable labels;
+  for (const auto& statement : statements) {
+    if (statement.kind == statement_kind::LABEL && statement.section == section_kind::CODE) {
+      labels.insert(statement.name, 0);
+    }
+  }
+  std::vector<size_t> relaxed{};
+  std::vector<uint8_t> wide_commands{};
+  for (size_t i = 0; i < statements.size(); ++i) {
+    Statement& statement = statements[i];
+    if (statement.kind != statement_kind::INSTRUCTION || !forms[statement.command].byte) {
+      continue;
+    }
+    const CompactForms& form = forms[statement.command];
+    bool absolute = statement.get_command().type == command_type::REGVAL;
+    if (absolute && !statement.operand.is_label()) {
+      auto value = static_cast<int32_t>(statement.operand.value);
+      statement.command = fits_operand(value, 1) ? form.byte : fits_operand(value, 2) ? form.word : statement.command;
+      continue;
+    }
+    if (statement.operand.is_label() && (!labels.find(statement.operand.label) || (absolute && object))) {
+      continue;
+    }
+    relaxed.push_back(i);
+    wide_commands.push_back(statement.command);
+    statement.command = form.byte;
+  }
+
+  std::vector<uint32_t> ends(statements.size(), 0);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    uint32_t position = 0;
+    for (size_t i = 0; i < statements.size(); ++i) {
+      if (statements[i].kind == statement_kind::LABEL && statements[i].section == section_kind::CODE) {
+        labels.insert(statements[i].name, position);
+      } else if (statements[i].kind == statement_kind::INSTRUCTION) {
+        position += static_cast<uint32_t>(instruction_size(statements[i].get_command()));
+      }
+      ends[i] = position;
+    }
+    for (size_t k = 0; k < relaxed.size(); ++k) {
+      Statement& statement = statements[relaxed[k]];
+      command_type type = statement.get_command().type;
+      uint32_t target = statement.operand.is_label() ? *labels.find(statement.operand.label) : statement.operand.value;
+      int64_t value = is_relative(type) ? static_cast<int64_t>(target) - ends[relaxed[k]] : target;
+      if (!fits_operand(value, operand_size(type))) {
+        const CompactForms& form = forms[wide_commands[k]];
+        statement.command = statement.command == form.byte ? form.word : wide_commands[k];
+        changed = true;
+      }
+    }
+  }
+}
+
+// Appends the text of a quoted string and its terminating zero
+inline void push_string(std::vector<uint8_t>& vec, std::string_view quoted, size_t line_number) {
+  for (size_t i = 1; i + 1 < quoted.size(); ++i) {
+    if (quoted[i] != '\\') {
+      vec.push_back(static_cast<uint8_t>(quoted[i]));
+      continue;
+    }
+    switch (quoted[++i]) {
+      case 'n':
+        vec.push_back('\n');
+        break;
+      case 't':
+        vec.push_back('\t');
+        break;
+      case '0':
+        vec.push_back(0);
+        break;
+      case '\\':
+      case '"':
+        vec.push_back(static_cast<uint8_t>(quoted[i]));
+        break;
+      default:
+        error("Invalid escape sequence in string", line_number);
+    }
+  }
+  vec.push_back(0);
+}
+
+inline void encode_data(const Statement& statement, std::vector<uint8_t>& output, std::vector<Fixup>& fixups) {
+  switch (statement.kind) {
+    case statement_kind::BYTE:
+      if (!fits_operand(static_cast<int32_t>(statement.operand.value), 1) && statement.operand.value > 0xff) {
+        error("Operand out of range", statement.line_number);
+      }
+      output.push_back(static_cast<uint8_t>(statement.operand.value));
+      break;
+    case statement_kind::WORD:
+      if (statement.operand.is_label()) {
+        fixups.push_back({output.size(), statement.operand.label, statement.line_number, command_type::LABEL,
+                          statement.section});
+      }
+      push_uint32(output, statement.operand.value);
+      break;
+    case statement_kind::STRING:
+      push_string(output, statement.name, statement.line_number);
+      break;
+    case statement_kind::ZERO:
+      output.resize(output.size() + statement.operand.value, 0);
+      break;
+    case statement_kind::ALIGN: {
+      uint32_t alignment = statement.operand.value;
+      if (!alignment || (alignment & (alignment - 1)) || alignment > DATA_ALIGNMENT) {
+        error("Alignment must be a power of two up to " + std::to_string(DATA_ALIGNMENT), statement.line_number);
+      }
+      output.resize(Image::align_up(static_cast<uint32_t>(output.size()), alignment), 0);
+      break;
+    }
+    default:;
+  }
+}
+
+// Appends an instruction and returns where its operand starts; a label operand is left zero
+inline size_t push_instruction(std::vector<uint8_t>& output, const Statement& statement) {
+  output.push_back(statement.command);
+  command_type type = statement.get_command().type;
+  for (size_t i = 0; i < register_count(type); ++i) {
+    output.push_back(statement.registers[i]);
+  }
+  size_t position = output.size();
+  output.resize(position + operand_size(type), 0);
+  if (has_operand(type) && !statement.operand.is_label()) {
+    write_operand(output, position, type, statement.operand.value, statement.line_number);
+  }
+  return position;
+}
+
+// Encodes statements one at a time into a runnable image, or into `object` if it is given.
+// Code labels are known as soon as they are declared, data labels only once every section is complete.
+//
+// A detached encoder takes a piece of the code section whose place in the image is not known yet: it
+// leaves every label address as a fixup, and the piece is placed with append.
+class Encoder {
+
+ public:
+  explicit Encoder(ObjectFile* object = nullptr, bool detached = false)
+      : object(object), detached(detached) {
+  }
+
+  // Copies write to the same object file, as the pieces of a parallel assembly do
+  Encoder(const Encoder&) = default;
+  Encoder(Encoder&&) = default;
+  Encoder& operator=(const Encoder&) = default;
+  Encoder& operator=(Encoder&&) = default;
+
+  void add(const Statement& statement) {
+    if (statement.kind == statement_kind::LABEL) {
+      auto offset = static_cast<uint32_t>(image.section(statement.section).size());
+      declare(statement.name, offset, statement.section, statement.line_number);
+      if (detached) {
+        declarations.push_back({offset, statement.name, statement.line_number});
+      }
+      return;
+    }
+    if (statement.kind == statement_kind::GLOBAL) {
+      globals.insert(statement.name, static_cast<uint32_t>(statement.line_number));
+      return;
+    }
+    if (statement.kind != statement_kind::INSTRUCTION) {
+      encode_data(statement, image.section(statement.section), fixups);
+      return;
+    }
+    std::vector<uint8_t>& output = image.code;
+    size_t position = push_instruction(output, statement);
+    if (!statement.operand.is_label()) {
+      return;
+    }
+    command_type type = statement.get_command().type;
+    if (object && operand_size(type) < 4 && !is_relative(type)) {
+      error("Label address needs a 32-bit operand in an object file", statement.line_number);
+    }
+    const uint32_t* label = labels.find(statement.operand.label);
+    if (label && !data_labels.find(statement.operand.label) && (!object || operand_size(type) < 4) &&
+        (!detached || is_relative(type))) {
+      write_operand(output, position, type, *label, statement.line_number);
+    } else {
+      fixups.push_back({position, statement.operand.label, statement.line_number, type, section_kind::CODE});
+    }
+  }
+
+  // Places the code of a detached encoder after the code encoded so far
+  void append(const Encoder& piece) {
+    auto base = static_cast<uint32_t>(image.code.size());
+    image.code.insert(image.code.end(), piece.image.code.begin(), piece.image.code.end());
+    for (const auto& declaration : piece.declarations) {
+      declare(declaration.name, base + declaration.offset, section_kind::CODE, declaration.line_number);
+    }
+    for (Fixup fixup : piece.fixups) {
+      fixup.position += base;
+      fixups.push_back(fixup);
+    }
+  }
+
+  // The labels of an image can be collected into `symbols`
+  std::vector<uint8_t> finish(SymbolTable* symbols = nullptr) {
+    globals.for_each([this](std::string_view name, uint32_t line_number) {
+      if (!labels.find(name)) {
+        error("Label not declared: " + std::string(name), line_number);
+      }
+    });
+    for (const auto& fixup : fixups) {
+      if (object && operand_size(fixup.type) == 4) {
+        object->relocations.push_back({static_cast<uint32_t>(fixup.position), std::string(fixup.label),
+                                       fixup.section});
+        continue;
+      }
+      const uint32_t* label = labels.find(fixup.label);
+      if (!label) {
+        error("Label not declared: " + std::string(fixup.label), fixup.line_number);
+      }
+      const uint32_t* section = data_labels.find(fixup.label);
+      uint32_t address = section ? image.address(static_cast<section_kind>(*section), *label) : *label;
+      write_operand(image.section(fixup.section), fixup.position, fixup.type, address, fixup.line_number);
+    }
+    if (object) {
+      labels.for_each([this](std::string_view name, uint32_t offset) {
+        object->symbols.push_back({std::string(name), offset, globals.find(name) != nullptr, section_of(name)});
+      });
+      std::sort(object->symbols.begin(), object->symbols.end(), [](const ObjectSymbol& a, const ObjectSymbol& b) {
+        return std::tie(a.section, a.offset, a.name) < std::tie(b.section, b.offset, b.name);
+      });
+      std::sort(object->relocations.begin(), object->relocations.end(), [](const Relocation& a, const Relocation& b) {
+        return std::tie(a.section, a.position) < std::tie(b.section, b.position);
+      });
+      object->code = image.code;
+      object->rodata = image.rodata;
+      object->data = image.data;
+      return image.code;
+    }
+    if (symbols) {
+      std::vector<Symbol> found;
+      labels.for_each([this, &found](std::string_view name, uint32_t offset) {
+        section_kind kind = section_of(name);
+        found.push_back({kind, image.address(kind, offset), std::string(name)});
+      });
+      *symbols = SymbolTable(std::move(found));
+    }
+    return write_image(image);
+  }
+
+ private:
+  struct Declaration {
+    uint32_t offset;
+    std::string_view name;
+    size_t line_number;
+  };
+
+  void declare(std::string_view name, uint32_t offset, section_kind section, size_t line_number) {
+    const uint32_t* label = labels.find(name);
+    if (label && (*label != offset || section_of(name) != section)) {
+      error("Label redeclared: " + std::string(name), line_number);
+    }
+    labels.insert(name, offset);
+    if (section != section_kind::CODE) {
+      data_labels.insert(name, static_cast<uint32_t>(section));
+    }
+  }
+
+  section_kind section_of(std::string_view name) const {
+    const uint32_t* section = data_labels.find(name);
+    return section ? static_cast<section_kind>(*section) : section_kind::CODE;
+  }
+
+  ObjectFile* object;
+  bool detached;
+  Image image{};
+  LabelTable labels{};
+  // Section of every label outside the code section
+  LabelTable data_labels{};
+  LabelTable globals{};
+  std::vector<Fixup> fixups{};
+  std::vector<Declaration> declarations{};
+};
+
+inline std::vector<uint8_t> encode(const std::vector<Statement>& statements, ObjectFile* object = nullptr,
+                                   SymbolTable* symbols = nullptr) {
+  Encoder encoder(object);
+  for (const auto& statement : statements) {
+    encoder.add(statement);
+  }
+  return encoder.finish(symbols);
+}
+
+inline std::vector<uint8_t> assemble(std::string_view program, ObjectFile* object = nullptr) {
+  return encode(parse(program), object);
+}
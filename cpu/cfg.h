@@ -0,0 +1,464 @@
+#pragma once
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+#include "decoder.h"
+
+// Control flow recovered by recursive descent from the entry point: basic blocks, functions (the entry
+// and every call target), the call graph, and natural loops found from dominators.
+// Code only reached through jmpr is not found.
+class ControlFlowGraph {
+
+ public:
+  explicit ControlFlowGraph(const std::vector<Instruction>& instructions)
+      : instructions(instructions), block_of(instructions.size(), NONE) {
+    if (instructions.empty()) {
+      return;
+    }
+    std::vector<bool> leaders(instructions.size(), false);
+    std::set<size_t> entries{0};
+    std::vector<bool> reached = explore(leaders, entries);
+    split_blocks(reached, leaders);
+    link_blocks();
+    function_at.assign(blocks.size(), NONE);
+    for (size_t entry : entries) {
+      function_at[block_of[entry]] = functions.size();
+      functions.push_back(Function{});
+      functions.back().entry = block_of[entry];
+    }
+    local.assign(blocks.size(), NONE);
+    for (auto& function : functions) {
+      function = build_function(function.entry);
+      for (size_t block : function.blocks) {
+        for (size_t callee : blocks[block].callees) {
+          function.callees.insert(function_at[callee]);
+        }
+      }
+    }
+  }
+
+  // One line per function, loop and block
+  std::string describe(const LabelNames& names) const {
+    std::string out;
+    size_t loops = 0;
+    for (const auto& function : functions) {
+      loops += function.loops.size();
+    }
+    out += "; " + std::to_string(functions.size()) + " functions, " + std::to_string(blocks.size()) + " blocks, " +
+           std::to_string(loops) + " loops, " + std::to_string(unreached_bytes) + " bytes not reached\n";
+    for (const auto& function : functions) {
+      out += "function ";
+      append_block_name(out, function.entry, names);
+      out += '\n';
+      if (!function.callees.empty()) {
+        out += "  calls";
+        for (size_t callee : function.callees) {
+          out += ' ';
+          append_block_name(out, functions[callee].entry, names);
+        }
+        out += '\n';
+      }
+      for (const auto& loop : function.loops) {
+        out += "  loop ";
+        append_block_name(out, loop.header, names);
+        out += " depth " + std::to_string(loop.depth) + ":";
+        for (size_t block : loop.blocks) {
+          out += ' ';
+          append_block_name(out, block, names);
+        }
+        out += '\n';
+      }
+      for (size_t block : function.blocks) {
+        out += "  block ";
+        append_block_name(out, block, names);
+        out += " [" + std::to_string(begin_of(block)) + ", " + std::to_string(end_of(block)) + ")";
+        if (!blocks[block].successors.empty()) {
+          out += " ->";
+          for (size_t successor : blocks[block].successors) {
+            out += ' ';
+            append_block_name(out, successor, names);
+          }
+        }
+        if (blocks[block].loop_depth) {
+          out += "  ; loop depth " + std::to_string(blocks[block].loop_depth);
+        }
+        out += '\n';
+      }
+    }
+    return out;
+  }
+
+  // Graphviz digraph with a cluster per function; dashed edges fall through a branch, red edges close
+  // a loop and dotted edges are calls
+  std::string to_dot(const std::vector<uint8_t>& program, const LabelNames& names) const {
+    std::string out = "digraph program {\n  node [shape=box, fontname=\"monospace\"];\n";
+    std::vector<bool> placed(blocks.size(), false);
+    for (size_t f = 0; f < functions.size(); ++f) {
+      out += "  subgraph cluster_" + std::to_string(f) + " {\n    label=\"";
+      append_escaped(out, block_name(functions[f].entry, names));
+      out += "\";\n";
+      for (size_t block : functions[f].blocks) {
+        if (placed[block]) {
+          continue;
+        }
+        placed[block] = true;
+        out += "    b" + std::to_string(begin_of(block)) + " [label=\"";
+        append_escaped(out, block_name(block, names));
+        out += "\\l";
+        for (size_t i = blocks[block].first; i <= blocks[block].last; ++i) {
+          std::string text;
+          append_instruction(text, program, instructions[i]);
+          if (instructions[i].target != NO_TARGET) {
+            text += ' ';
+            if (find_instruction(instructions[i].target) != NONE) {
+              names.append(text, instructions[i].target);
+            } else if (instructions[i].target == program.size()) {
+              text += names.get(section_kind::CODE, instructions[i].target, "@end");
+            } else {
+              text += std::to_string(instructions[i].target);
+            }
+          }
+          append_escaped(out, text);
+          out += "\\l";
+        }
+        out += "\"";
+        out += blocks[block].loop_depth ? ", style=bold];\n" : "];\n";
+      }
+      out += "  }\n";
+    }
+    for (const auto& function : functions) {
+      for (size_t block : function.blocks) {
+        const Block& from = blocks[block];
+        for (size_t successor : from.successors) {
+          out += "  b" + std::to_string(begin_of(block)) + " -> b" + std::to_string(begin_of(successor));
+          if (is_back_edge(block, successor)) {
+            out += " [color=red]";
+          } else if (instructions[from.last].get_command().flow == control_flow::BRANCH &&
+                     from.last + 1 < instructions.size() && successor == block_of[from.last + 1] &&
+                     instructions[from.last].target != instructions[from.last + 1].offset) {
+            out += " [style=dashed]";
+          }
+          out += ";\n";
+        }
+        for (size_t callee : from.callees) {
+          out += "  b" + std::to_string(begin_of(block)) + " -> b" + std::to_string(begin_of(callee)) +
+                 " [style=dotted, constraint=false];\n";
+        }
+      }
+    }
+    out += "}\n";
+    return out;
+  }
+
+ private:
+  static constexpr size_t NONE = static_cast<size_t>(-1);
+
+  struct Block {
+    size_t first{0};
+    size_t last{0};
+    std::vector<size_t> successors{};
+    std::vector<size_t> predecessors{};
+    // Entry blocks of the functions called from the block
+    std::vector<size_t> callees{};
+    size_t loop_depth{0};
+  };
+
+  struct Loop {
+    size_t header{0};
+    std::vector<size_t> blocks{};
+    size_t depth{1};
+  };
+
+  struct Function {
+    size_t entry{0};
+    // In program order
+    std::vector<size_t> blocks{};
+    std::vector<Loop> loops{};
+    std::set<size_t> callees{};
+  };
+
+  size_t find_instruction(uint32_t offset) const {
+    auto it = std::lower_bound(instructions.begin(), instructions.end(), offset,
+                               [](const Instruction& instruction, uint32_t value) {
+                                 return instruction.offset < value;
+                               });
+    return it != instructions.end() && it->offset == offset ? static_cast<size_t>(it - instructions.begin()) : NONE;
+  }
+
+  std::vector<bool> explore(std::vector<bool>& leaders, std::set<size_t>& entries) {
+    std::vector<bool> reached(instructions.size(), false);
+    std::vector<size_t> work{0};
+    leaders[0] = true;
+    auto follow = [&](size_t index, bool leader) {
+      if (index != NONE && index < instructions.size()) {
+        leaders[index] = leaders[index] || leader;
+        work.push_back(index);
+      }
+    };
+    while (!work.empty()) {
+      size_t i = work.back();
+      work.pop_back();
+      if (reached[i]) {
+        continue;
+      }
+      reached[i] = true;
+      size_t target = instructions[i].target == NO_TARGET ? NONE : find_instruction(instructions[i].target);
+      switch (instructions[i].get_command().flow) {
+        case control_flow::NONE:
+          follow(i + 1, false);
+          break;
+        case control_flow::CALL:
+          if (target != NONE) {
+            entries.insert(target);
+          }
+          follow(target, true);
+          follow(i + 1, false);
+          break;
+        case control_flow::JUMP:
+          follow(target, true);
+          break;
+        case control_flow::BRANCH:
+          follow(target, true);
+          follow(i + 1, true);
+          break;
+        case control_flow::RETURN:
+        case control_flow::INDIRECT:
+          break;
+      }
+    }
+    return reached;
+  }
+
+  void split_blocks(const std::vector<bool>& reached, const std::vector<bool>& leaders) {
+    bool open = false;
+    for (size_t i = 0; i < instructions.size(); ++i) {
+      if (!reached[i]) {
+        open = false;
+        unreached_bytes += instructions[i].size;
+        continue;
+      }
+      if (!open || leaders[i]) {
+        blocks.push_back(Block{});
+        blocks.back().first = i;
+        open = true;
+      }
+      blocks.back().last = i;
+      block_of[i] = blocks.size() - 1;
+      control_flow flow = instructions[i].get_command().flow;
+      open = flow == control_flow::NONE || flow == control_flow::CALL;
+    }
+  }
+
+  void link_blocks() {
+    for (size_t b = 0; b < blocks.size(); ++b) {
+      Block& block = blocks[b];
+      for (size_t i = block.first; i <= block.last; ++i) {
+        if (instructions[i].get_command().flow == control_flow::CALL) {
+          size_t target = find_instruction(instructions[i].target);
+          if (target != NONE) {
+            block.callees.push_back(block_of[target]);
+          }
+        }
+      }
+      const Instruction& last = instructions[block.last];
+      size_t target = last.target == NO_TARGET ? NONE : find_instruction(last.target);
+      size_t next = block.last + 1 < instructions.size() ? block_of[block.last + 1] : NONE;
+      switch (last.get_command().flow) {
+        case control_flow::JUMP:
+          add_edge(b, target == NONE ? NONE : block_of[target]);
+          break;
+        case control_flow::BRANCH:
+          add_edge(b, target == NONE ? NONE : block_of[target]);
+          add_edge(b, next);
+          break;
+        case control_flow::NONE:
+        case control_flow::CALL:
+          add_edge(b, next);
+          break;
+        case control_flow::RETURN:
+        case control_flow::INDIRECT:
+          break;
+      }
+    }
+  }
+
+  void add_edge(size_t from, size_t to) {
+    if (to == NONE || std::find(blocks[from].successors.begin(), blocks[from].successors.end(), to) !=
+                      blocks[from].successors.end()) {
+      return;
+    }
+    blocks[from].successors.push_back(to);
+    blocks[to].predecessors.push_back(from);
+  }
+
+  // Blocks reachable from the entry without following calls or entering another function, their
+  // dominators (Cooper, Harvey and Kennedy's iterative algorithm over reverse postorder) and the
+  // natural loop of every back edge
+  Function build_function(size_t entry) {
+    Function function;
+    function.entry = entry;
+    std::vector<size_t> postorder;
+    std::vector<std::pair<size_t, size_t>> stack{{entry, 0}};
+    local[entry] = 0;
+    function.blocks.push_back(entry);
+    while (!stack.empty()) {
+      auto& top = stack.back();
+      if (top.second < blocks[top.first].successors.size()) {
+        size_t successor = blocks[top.first].successors[top.second++];
+        if (local[successor] == NONE && function_at[successor] == NONE) {
+          local[successor] = 0;
+          function.blocks.push_back(successor);
+          stack.emplace_back(successor, 0);
+        }
+        continue;
+      }
+      postorder.push_back(top.first);
+      stack.pop_back();
+    }
+    for (size_t i = 0; i < postorder.size(); ++i) {
+      local[postorder[i]] = i;
+    }
+
+    std::vector<size_t> idom(postorder.size(), NONE);
+    idom[local[entry]] = local[entry];
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (auto it = postorder.rbegin(); it != postorder.rend(); ++it) {
+        if (*it == entry) {
+          continue;
+        }
+        size_t dominator = NONE;
+        for (size_t predecessor : blocks[*it].predecessors) {
+          size_t p = local[predecessor];
+          if (p != NONE && idom[p] != NONE) {
+            dominator = dominator == NONE ? p : intersect(idom, p, dominator);
+          }
+        }
+        if (dominator != idom[local[*it]]) {
+          idom[local[*it]] = dominator;
+          changed = true;
+        }
+      }
+    }
+
+    for (size_t block : function.blocks) {
+      for (size_t successor : blocks[block].successors) {
+        if (local[successor] != NONE && dominates(idom, local[successor], local[block])) {
+          back_edges.emplace(block, successor);
+          add_to_loop(function, successor, block);
+        }
+      }
+    }
+
+    // Natural loops are nested or disjoint, so the depth of a block is the number of loops holding it
+    std::vector<size_t> depth(postorder.size(), 0);
+    for (auto& loop : function.loops) {
+      std::sort(loop.blocks.begin(), loop.blocks.end());
+      for (size_t block : loop.blocks) {
+        ++depth[local[block]];
+      }
+    }
+    for (auto& loop : function.loops) {
+      loop.depth = depth[local[loop.header]];
+    }
+    for (size_t block : function.blocks) {
+      blocks[block].loop_depth = std::max(blocks[block].loop_depth, depth[local[block]]);
+      local[block] = NONE;
+    }
+    std::sort(function.blocks.begin(), function.blocks.end());
+    return function;
+  }
+
+  static size_t intersect(const std::vector<size_t>& idom, size_t a, size_t b) {
+    while (a != b) {
+      while (a < b) {
+        a = idom[a];
+      }
+      while (b < a) {
+        b = idom[b];
+      }
+    }
+    return a;
+  }
+
+  // In postorder numbering, walking up the dominator tree only increases the number
+  static bool dominates(const std::vector<size_t>& idom, size_t a, size_t b) {
+    while (b != a && idom[b] != b && idom[b] != NONE) {
+      b = idom[b];
+    }
+    return a == b;
+  }
+
+  // Blocks that reach `tail` without passing through `header`; loops sharing a header are merged
+  void add_to_loop(Function& function, size_t header, size_t tail) {
+    auto loop = std::find_if(function.loops.begin(), function.loops.end(), [header](const Loop& l) {
+      return l.header == header;
+    });
+    if (loop == function.loops.end()) {
+      function.loops.push_back(Loop{});
+      loop = function.loops.end() - 1;
+      loop->header = header;
+      loop->blocks.push_back(header);
+    }
+    std::set<size_t> members(loop->blocks.begin(), loop->blocks.end());
+    std::vector<size_t> work{tail};
+    while (!work.empty()) {
+      size_t block = work.back();
+      work.pop_back();
+      if (!members.insert(block).second) {
+        continue;
+      }
+      loop->blocks.push_back(block);
+      for (size_t predecessor : blocks[block].predecessors) {
+        if (local[predecessor] != NONE) {
+          work.push_back(predecessor);
+        }
+      }
+    }
+  }
+
+  bool is_back_edge(size_t from, size_t to) const {
+    return back_edges.count(std::make_pair(from, to)) != 0;
+  }
+
+  uint32_t begin_of(size_t block) const {
+    return instructions[blocks[block].first].offset;
+  }
+
+  uint32_t end_of(size_t block) const {
+    return instructions[blocks[block].last].offset + instructions[blocks[block].last].size;
+  }
+
+  void append_block_name(std::string& out, size_t block, const LabelNames& names) const {
+    names.append(out, begin_of(block));
+  }
+
+  std::string block_name(size_t block, const LabelNames& names) const {
+    std::string out;
+    append_block_name(out, block, names);
+    return out;
+  }
+
+  static void append_escaped(std::string& out, const std::string& text) {
+    for (char c : text) {
+      if (c == '"' || c == '\\') {
+        out += '\\';
+      }
+      out += c;
+    }
+  }
+
+  const std::vector<Instruction>& instructions;
+  std::vector<size_t> block_of;
+  std::vector<Block> blocks{};
+  std::vector<Function> functions{};
+  // Function entered at a block, NONE for the other blocks
+  std::vector<size_t> function_at{};
+  // Position of a block in the postorder of the function being built, NONE outside it
+  std::vector<size_t> local{};
+  std::set<std::pair<size_t, size_t>> back_edges{};
+  size_t unreached_bytes{0};
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+// Bounded lock-free multi-producer multi-consumer queue of 32-bit words
+// (D. Vyukov's sequence-numbered ring buffer)
+class Channel {
+
+ public:
+  explicit Channel(size_t capacity)
+      : mask(round_up_capacity(capacity) - 1), cells(new Cell[mask + 1]) {
+    for (size_t i = 0; i <= mask; ++i) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  Channel(const Channel&) = delete;
+  Channel& operator=(const Channel&) = delete;
+
+  bool try_send(uint32_t value) {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells[pos & mask];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = value;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool try_recv(uint32_t& value) {
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells[pos & mask];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    value = cell->value;
+    cell->sequence.store(pos + mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Receivers drain what is left and then see the end of stream, senders fail
+  void close() {
+    closed.store(true, std::memory_order_release);
+  }
+
+  bool is_closed() const {
+    return closed.load(std::memory_order_acquire);
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence{0};
+    uint32_t value{0};
+  };
+
+  static size_t round_up_capacity(size_t capacity) {
+    if (capacity < 2) {
+      throw std::invalid_argument("Channel capacity must be at least 2");
+    }
+    size_t res = 1;
+    while (res < capacity) {
+      res <<= 1;
+    }
+    return res;
+  }
+
+  const size_t mask;
+  std::unique_ptr<Cell[]> cells;
+  alignas(64) std::atomic<size_t> enqueue_pos{0};
+  alignas(64) std::atomic<size_t> dequeue_pos{0};
+  alignas(64) std::atomic<bool> closed{false};
+};
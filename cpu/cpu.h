@@ -1,17 +1,35 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
+#include <cstring>
 #include <stdexcept>
+#include <string>
 #include <vector>
 #include <functional>
+#include <memory>
+#include <thread>
+#include "channel.h"
+#include "image.h"
+#include "profiler.h"
+#include "simd.h"
+#include "symbols.h"
 
 constexpr uint8_t REG_STACK = 0xfe;
 constexpr uint8_t REG_INSTRUCTION = 0xff;
 
 constexpr uint8_t CPU_VERSION = 1;
 
+// The 8 and 16-bit forms are the compact encodings of REGVAL and LABEL: REGVAL8/16 immediates are
+// sign-extended, LABEL8/16 hold a signed offset from the end of the instruction
 enum class command_type {
-  SIMPLE, REG, REGREG, REGVAL, LABEL
+  SIMPLE, REG, REGREG, REGREGREG, REGVAL, LABEL, VECVEC, VECREG, REGVEC, REGVAL8, REGVAL16, LABEL8, LABEL16
+};
+
+// How a command affects the instruction pointer, used by coverage and by the tools
+enum class control_flow {
+  NONE, JUMP, BRANCH, CALL, RETURN, INDIRECT
 };
 
 class CPU;
@@ -20,6 +38,7 @@ struct CommandData {
 
   uint8_t reg1{0};
   uint8_t reg2{0};
+  uint8_t reg3{0};
   uint32_t value{0};
 };
 
@@ -28,13 +47,18 @@ using command_handler = std::function<void(CPU&, const CommandData&)>;
 struct Command {
 
   Command(std::string mnemonic, command_type type, bool sets_flags, command_handler handler)
-      : handler(std::move(handler)), mnemonic(std::move(mnemonic)), type(type), sets_flags(sets_flags) {
+      : Command(std::move(mnemonic), type, sets_flags, control_flow::NONE, std::move(handler)) {
+  };
+
+  Command(std::string mnemonic, command_type type, bool sets_flags, control_flow flow, command_handler handler)
+      : handler(std::move(handler)), mnemonic(std::move(mnemonic)), type(type), sets_flags(sets_flags), flow(flow) {
   };
 
   command_handler handler;
   std::string mnemonic;
   command_type type;
   bool sets_flags;
+  control_flow flow;
 
 
 };
@@ -66,23 +90,48 @@ class CPU {
 
  public:
   CPU(uint32_t memory_size)
-      : memory(memory_size) {
+      : memory(memory_size), vector_registers() {
   };
 
+  // A copy would share the profiler and the symbols it points to
+  CPU(const CPU&) = delete;
+  CPU& operator=(const CPU&) = delete;
+
   void install_program(const std::vector<uint8_t>& program) {
-    if (program.size() > memory.size()) {
+    try {
+      install_program(read_image(program));
+    } catch (const ImageError& e) {
+      throw CPUError(e.what());
+    }
+  }
+
+  void install_program(const Image& image) {
+    const std::vector<uint8_t>& program = image.code;
+    size_t data_end_address = image.data_address() + image.data.size();
+    if (program.size() > memory.size() || data_end_address > memory.size() - program.size()) {
       throw CPUError("Not enough memory");
     }
     std::fill(memory.begin(), memory.end() - program.size(), 0);
+    std::copy(image.rodata.begin(), image.rodata.end(), memory.begin());
+    std::copy(image.data.begin(), image.data.end(), memory.begin() + image.data_address());
     std::copy(program.begin(), program.end(), memory.end() - program.size());
+    readonly_end = static_cast<uint32_t>(image.rodata.size());
+    data_end = static_cast<uint32_t>(data_end_address);
     std::fill(registers.begin(), registers.end(), 0);
+    std::fill(vector_registers.begin(), vector_registers.end(), VectorRegister{});
     registers[REG_INSTRUCTION] = static_cast<uint32_t>(memory.size() - program.size());
     program_offset = registers[REG_INSTRUCTION];
     registers[REG_STACK] = program_offset;
     flags.clear();
+    if (coverage_enabled) {
+      coverage.assign((program.size() + 7) / 8, 0);
+      mark_block(0);
+    }
   }
 
   bool run_command() {
+    // Only the command run now may be waiting on a channel
+    blocked = false;
     uint32_t addr = registers[REG_INSTRUCTION];
     if (addr >= memory.size()) {
       return true;
@@ -99,13 +148,39 @@ class CPU {
         data.reg1 = get_value_8();
         break;
       case command_type::REGREG:
+      case command_type::VECVEC:
+      case command_type::VECREG:
+      case command_type::REGVEC:
         data.reg1 = get_value_8();
         data.reg2 = get_value_8();
         break;
+      case command_type::REGREGREG:
+        data.reg1 = get_value_8();
+        data.reg2 = get_value_8();
+        data.reg3 = get_value_8();
+        break;
       case command_type::REGVAL:
         data.reg1 = get_value_8();
       case command_type::LABEL:
         data.value = get_value_32();
+        break;
+      case command_type::REGVAL8:
+        data.reg1 = get_value_8();
+        data.value = static_cast<uint32_t>(static_cast<int8_t>(get_value_8()));
+        break;
+      case command_type::REGVAL16:
+        data.reg1 = get_value_8();
+        data.value = static_cast<uint32_t>(static_cast<int16_t>(get_value_16()));
+        break;
+      // Handlers see the target as a program offset, the same as for the 32-bit form
+      case command_type::LABEL8:
+        data.value = static_cast<uint32_t>(static_cast<int8_t>(get_value_8()));
+        data.value += shifted_ri - program_offset;
+        break;
+      case command_type::LABEL16:
+        data.value = static_cast<uint32_t>(static_cast<int16_t>(get_value_16()));
+        data.value += shifted_ri - program_offset;
+        break;
       case command_type::SIMPLE:;
     }
 
@@ -113,6 +188,14 @@ class CPU {
     if (commands[command_id].sets_flags) {
       flags.set_from(registers[data.reg1]);
     }
+    if (coverage_enabled && commands[command_id].flow != control_flow::NONE) {
+      mark_block(shifted_ri - program_offset);
+    }
+    if (profiler && commands[command_id].flow == control_flow::CALL) {
+      profiler->enter(shifted_ri - program_offset);
+    } else if (profiler && commands[command_id].flow == control_flow::RETURN) {
+      profiler->leave();
+    }
     registers[REG_INSTRUCTION] = shifted_ri;
 
     return false;
@@ -120,9 +203,63 @@ class CPU {
 
   void run_until_complete() {
     while (!run_command()) {
+      if (blocked) {
+        std::this_thread::yield();
+      }
     };
   }
 
+  // True if the last command is waiting on a channel and will be retried
+  bool is_blocked() const {
+    return blocked;
+  }
+
+  // Coverage marks the first instruction of every basic block entered after a jump, a call,
+  // a return or a branch (taken or not); must be enabled before install_program
+  void set_coverage_enabled(bool enabled) {
+    coverage_enabled = enabled;
+  }
+
+  // One bit per program byte offset, least significant bit first
+  const std::vector<uint8_t>& get_coverage() const {
+    return coverage;
+  }
+
+  // Records every guest data access; the profiler is owned by the caller
+  void set_memory_profiler(MemoryProfiler* memory_profiler) {
+    profiler = memory_profiler;
+  }
+
+  // Used to name addresses; the table is owned by the caller
+  void set_symbol_table(const SymbolTable* table) {
+    symbols = table;
+  }
+
+  // `@name` or `@name+distance` for an address in the program or its data, for traces and crash reports
+  std::string symbolize(uint32_t address) const {
+    if (address >= program_offset) {
+      std::string name = symbols ? symbols->describe(section_kind::CODE, address - program_offset) : "";
+      return name.empty() ? "offset " + std::to_string(address - program_offset) : name;
+    }
+    std::string name;
+    if (symbols && address < data_end) {
+      name = symbols->describe(address < readonly_end ? section_kind::RODATA : section_kind::DATA, address);
+    }
+    return name.empty() ? "address " + std::to_string(address) : name;
+  }
+
+  // Address of the command being run, or of the one that failed
+  uint32_t get_instruction_address() const {
+    return registers[REG_INSTRUCTION];
+  }
+
+  void attach_channel(uint32_t id, std::shared_ptr<Channel> channel) {
+    if (id >= channels.size()) {
+      channels.resize(id + 1);
+    }
+    channels[id] = std::move(channel);
+  }
+
   void set_input_function(std::function<uint32_t(void)> f) {
     input_function = std::move(f);
   }
@@ -143,33 +280,51 @@ class CPU {
     return memory[shifted_ri - 1];
   }
 
+  uint16_t get_value_16() {
+    shifted_ri += 2;
+    if (shifted_ri > memory.size()) {
+      throw CPUError("Truncated command");
+    }
+    return static_cast<uint16_t>(memory[shifted_ri - 2] | (memory[shifted_ri - 1] << 8));
+  }
+
   uint32_t get_value_32() {
     shifted_ri += 4;
     if (shifted_ri > memory.size()) {
       throw CPUError("Truncated command");
     }
-    return read_from_memory_32(shifted_ri - 4);
+    return static_cast<uint32_t>(memory[shifted_ri - 4]) | (static_cast<uint32_t>(memory[shifted_ri - 3]) << 8) |
+           (static_cast<uint32_t>(memory[shifted_ri - 2]) << 16) | (static_cast<uint32_t>(memory[shifted_ri - 1]) << 24);
   }
 
   void write_to_memory_8(uint32_t addr, uint8_t value) {
-    if (static_cast<size_t>(addr) + 1 > memory.size()) {
+    if (static_cast<size_t>(addr) + 1 > memory.size() || addr < readonly_end) {
       throw CPUError("Invalid write");
     }
+    if (profiler) {
+      profiler->record(addr, 1, true);
+    }
     memory[addr] = value;
   }
 
   void write_to_memory_16(uint32_t addr, uint16_t value) {
-    if (static_cast<size_t>(addr) + 2 > memory.size()) {
+    if (static_cast<size_t>(addr) + 2 > memory.size() || addr < readonly_end) {
       throw CPUError("Invalid write");
     }
+    if (profiler) {
+      profiler->record(addr, 2, true);
+    }
     memory[addr] = static_cast<uint8_t>(value);
     memory[addr + 1] = static_cast<uint8_t>(value >> 8);
   }
 
   void write_to_memory_32(uint32_t addr, uint32_t value) {
-    if (static_cast<size_t>(addr) + 4 > memory.size()) {
+    if (static_cast<size_t>(addr) + 4 > memory.size() || addr < readonly_end) {
       throw CPUError("Invalid write");
     }
+    if (profiler) {
+      profiler->record(addr, 4, true);
+    }
     memory[addr] = static_cast<uint8_t>(value);
     memory[addr + 1] = static_cast<uint8_t>(value >> 8);
     memory[addr + 2] = static_cast<uint8_t>(value >> 16);
@@ -180,6 +335,9 @@ class CPU {
     if (static_cast<size_t>(addr) + 1 > memory.size()) {
       throw CPUError("Invalid read");
     }
+    if (profiler) {
+      profiler->record(addr, 1, false);
+    }
     return memory[addr];
   }
 
@@ -187,6 +345,9 @@ class CPU {
     if (static_cast<size_t>(addr) + 2 > memory.size()) {
       throw CPUError("Invalid read");
     }
+    if (profiler) {
+      profiler->record(addr, 2, false);
+    }
     return static_cast<uint16_t>(memory[addr]) | (static_cast<uint16_t>(memory[addr + 1]) << 8);
   }
 
@@ -194,12 +355,52 @@ class CPU {
     if (static_cast<size_t>(addr) + 4 > memory.size()) {
       throw CPUError("Invalid read");
     }
+    if (profiler) {
+      profiler->record(addr, 4, false);
+    }
     return static_cast<uint32_t>(memory[addr]) | (static_cast<uint32_t>(memory[addr + 1]) << 8) |
            (static_cast<uint32_t>(memory[addr + 2]) << 16) | (static_cast<uint32_t>(memory[addr + 3]) << 24);
   }
 
+  void check_memory_range(uint32_t addr, uint32_t size, bool write) {
+    if (static_cast<size_t>(addr) + size > memory.size() || (write && size && addr < readonly_end)) {
+      throw CPUError(write ? "Invalid write" : "Invalid read");
+    }
+    if (profiler && size) {
+      profiler->record(addr, size, write);
+    }
+  }
+
+  VectorRegister& get_vector_register(uint8_t index) {
+    if (index >= VECTOR_REGISTERS) {
+      throw CPUError("Invalid vector register");
+    }
+    return vector_registers[index];
+  }
+
+  void mark_block(uint32_t offset) {
+    if (offset / 8 < coverage.size()) {
+      coverage[offset / 8] |= static_cast<uint8_t>(1u << (offset % 8));
+    }
+  }
+
+  Channel& get_channel(uint32_t id) {
+    if (id >= channels.size() || !channels[id]) {
+      throw CPUError("Invalid channel");
+    }
+    return *channels[id];
+  }
+
+  void block() {
+    shifted_ri = registers[REG_INSTRUCTION];
+    blocked = true;
+  }
+
   void push_on_stack(uint32_t value) {
     write_to_memory_32(registers[REG_STACK] -= 4, value);
+    if (profiler) {
+      profiler->record_stack_depth(program_offset - registers[REG_STACK]);
+    }
   }
 
   uint32_t pop_from_stack() {
@@ -217,10 +418,20 @@ class CPU {
  private:
   std::vector<uint8_t> memory;
   std::array<uint32_t, 256> registers;
+  std::array<VectorRegister, VECTOR_REGISTERS> vector_registers;
   uint32_t program_offset{0};
+  // Rodata occupies the addresses below this one
+  uint32_t readonly_end{0};
+  uint32_t data_end{0};
   uint32_t shifted_ri{0};
   std::function<uint32_t(void)> input_function{nullptr};
   std::function<void(uint32_t)> output_function{nullptr};
+  std::vector<std::shared_ptr<Channel>> channels{};
+  bool blocked{false};
+  MemoryProfiler* profiler{nullptr};
+  const SymbolTable* symbols{nullptr};
+  bool coverage_enabled{false};
+  std::vector<uint8_t> coverage{};
   Flags flags;
 };
 
@@ -325,47 +536,198 @@ const std::vector<Command> CPU::commands =
         {"not",     command_type::REG,    true,  [](CPU& cpu, const CommandData& data) {
           cpu.registers[data.reg1] = ~cpu.registers[data.reg1];
         }},
-        {"call",    command_type::LABEL,    false, [](CPU& cpu, const CommandData& data) {
+        {"call",    command_type::LABEL,  false, control_flow::CALL, [](CPU& cpu, const CommandData& data) {
           cpu.push_on_stack(cpu.shifted_ri);
           cpu.shifted_ri = data.value + cpu.program_offset;
         }},
-        {"ret",     command_type::SIMPLE, false, [](CPU& cpu, const CommandData& data) {
+        {"ret",     command_type::SIMPLE, false, control_flow::RETURN, [](CPU& cpu, const CommandData& data) {
           cpu.shifted_ri = cpu.pop_from_stack();
         }},
-        {"jmp",     command_type::LABEL,    false, [](CPU& cpu, const CommandData& data) {
+        {"jmp",     command_type::LABEL,  false, control_flow::JUMP, [](CPU& cpu, const CommandData& data) {
           cpu.shifted_ri = data.value + cpu.program_offset;
         }},
-        {"jiz",     command_type::LABEL,    false, [](CPU& cpu, const CommandData& data) {
+        {"jiz",     command_type::LABEL,  false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
           if (cpu.flags.zero) {
             cpu.shifted_ri = data.value + cpu.program_offset;
           }
         }},
-        {"juz",     command_type::LABEL,    false, [](CPU& cpu, const CommandData& data) {
+        {"juz",     command_type::LABEL,  false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
           if (!cpu.flags.zero) {
             cpu.shifted_ri = data.value + cpu.program_offset;
           }
         }},
-        {"jis",     command_type::LABEL,    false, [](CPU& cpu, const CommandData& data) {
+        {"jis",     command_type::LABEL,  false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
           if (cpu.flags.sign) {
             cpu.shifted_ri = data.value + cpu.program_offset;
           }
         }},
-        {"jus",     command_type::LABEL,    false, [](CPU& cpu, const CommandData& data) {
+        {"jus",     command_type::LABEL,  false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
           if (!cpu.flags.sign) {
             cpu.shifted_ri = data.value + cpu.program_offset;
           }
         }},
-        {"jio",     command_type::LABEL,    false, [](CPU& cpu, const CommandData& data) {
+        {"jio",     command_type::LABEL,  false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
           if (cpu.flags.overflow) {
             cpu.shifted_ri = data.value + cpu.program_offset;
           }
         }},
-        {"juo",     command_type::LABEL,    false, [](CPU& cpu, const CommandData& data) {
+        {"juo",     command_type::LABEL,  false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
           if (!cpu.flags.overflow) {
             cpu.shifted_ri = data.value + cpu.program_offset;
           }
         }},
-        {"jmpr",    command_type::REG,    false, [](CPU& cpu, const CommandData& data) {
+        {"jmpr",    command_type::REG,    false, control_flow::INDIRECT, [](CPU& cpu, const CommandData& data) {
           cpu.shifted_ri = cpu.registers[data.reg1] + cpu.program_offset;
         }},
+        {"memcpy",  command_type::REGREGREG, false, [](CPU& cpu, const CommandData& data) {
+          uint32_t size = cpu.registers[data.reg3];
+          cpu.check_memory_range(cpu.registers[data.reg2], size, false);
+          cpu.check_memory_range(cpu.registers[data.reg1], size, true);
+          std::memmove(cpu.memory.data() + cpu.registers[data.reg1], cpu.memory.data() + cpu.registers[data.reg2], size);
+        }},
+        {"memset",  command_type::REGREGREG, false, [](CPU& cpu, const CommandData& data) {
+          uint32_t size = cpu.registers[data.reg3];
+          cpu.check_memory_range(cpu.registers[data.reg1], size, true);
+          std::memset(cpu.memory.data() + cpu.registers[data.reg1], static_cast<uint8_t>(cpu.registers[data.reg2]), size);
+        }},
+        {"memcmp",  command_type::REGREGREG, true,  [](CPU& cpu, const CommandData& data) {
+          uint32_t size = cpu.registers[data.reg3];
+          cpu.check_memory_range(cpu.registers[data.reg1], size, false);
+          cpu.check_memory_range(cpu.registers[data.reg2], size, false);
+          int res = std::memcmp(cpu.memory.data() + cpu.registers[data.reg1],
+                                cpu.memory.data() + cpu.registers[data.reg2], size);
+          cpu.registers[data.reg1] = static_cast<uint32_t>(res < 0 ? -1 : res > 0);
+        }},
+        {"vload",   command_type::VECREG, false, [](CPU& cpu, const CommandData& data) {
+          cpu.check_memory_range(cpu.registers[data.reg2], VECTOR_SIZE, false);
+          cpu.get_vector_register(data.reg1).load(cpu.memory.data() + cpu.registers[data.reg2]);
+        }},
+        {"vstore",  command_type::REGVEC, false, [](CPU& cpu, const CommandData& data) {
+          cpu.check_memory_range(cpu.registers[data.reg1], VECTOR_SIZE, true);
+          cpu.get_vector_register(data.reg2).store(cpu.memory.data() + cpu.registers[data.reg1]);
+        }},
+        {"vsplat",  command_type::VECREG, false, [](CPU& cpu, const CommandData& data) {
+          cpu.get_vector_register(data.reg1).splat(cpu.registers[data.reg2]);
+        }},
+        {"vmov",    command_type::VECVEC, false, [](CPU& cpu, const CommandData& data) {
+          cpu.get_vector_register(data.reg1) = cpu.get_vector_register(data.reg2);
+        }},
+        {"vadd",    command_type::VECVEC, false, [](CPU& cpu, const CommandData& data) {
+          cpu.get_vector_register(data.reg1).add(cpu.get_vector_register(data.reg2));
+        }},
+        {"vsub",    command_type::VECVEC, false, [](CPU& cpu, const CommandData& data) {
+          cpu.get_vector_register(data.reg1).sub(cpu.get_vector_register(data.reg2));
+        }},
+        {"vmul",    command_type::VECVEC, false, [](CPU& cpu, const CommandData& data) {
+          cpu.get_vector_register(data.reg1).mul(cpu.get_vector_register(data.reg2));
+        }},
+        {"vcmpeq",  command_type::VECVEC, false, [](CPU& cpu, const CommandData& data) {
+          cpu.get_vector_register(data.reg1).compare_equal(cpu.get_vector_register(data.reg2));
+        }},
+        {"vcmpgt",  command_type::VECVEC, false, [](CPU& cpu, const CommandData& data) {
+          cpu.get_vector_register(data.reg1).compare_greater(cpu.get_vector_register(data.reg2));
+        }},
+        {"vsum",    command_type::REGVEC, true,  [](CPU& cpu, const CommandData& data) {
+          cpu.registers[data.reg1] = cpu.get_vector_register(data.reg2).sum();
+        }},
+        {"send",    command_type::REGREG, false, [](CPU& cpu, const CommandData& data) {
+          Channel& channel = cpu.get_channel(cpu.registers[data.reg1]);
+          if (channel.is_closed()) {
+            throw CPUError("Send to closed channel");
+          }
+          if (!channel.try_send(cpu.registers[data.reg2])) {
+            cpu.block();
+          }
+        }},
+        {"recv",    command_type::REGREG, false, [](CPU& cpu, const CommandData& data) {
+          Channel& channel = cpu.get_channel(cpu.registers[data.reg2]);
+          uint32_t value{0};
+          if (channel.try_recv(value)) {
+            cpu.registers[data.reg1] = value;
+          } else if (!channel.is_closed()) {
+            cpu.block();
+          } else {
+            cpu.registers[data.reg1] = channel.try_recv(value) ? value : static_cast<uint32_t>(-1);
+          }
+        }},
+        {"set.b",   command_type::REGVAL8, false, [](CPU& cpu, const CommandData& data) {
+          cpu.registers[data.reg1] = data.value;
+        }},
+        {"set.w",   command_type::REGVAL16, false, [](CPU& cpu, const CommandData& data) {
+          cpu.registers[data.reg1] = data.value;
+        }},
+        {"call.b",  command_type::LABEL8, false, control_flow::CALL, [](CPU& cpu, const CommandData& data) {
+          cpu.push_on_stack(cpu.shifted_ri);
+          cpu.shifted_ri = data.value + cpu.program_offset;
+        }},
+        {"jmp.b",   command_type::LABEL8, false, control_flow::JUMP, [](CPU& cpu, const CommandData& data) {
+          cpu.shifted_ri = data.value + cpu.program_offset;
+        }},
+        {"jiz.b",   command_type::LABEL8, false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
+          if (cpu.flags.zero) {
+            cpu.shifted_ri = data.value + cpu.program_offset;
+          }
+        }},
+        {"juz.b",   command_type::LABEL8, false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
+          if (!cpu.flags.zero) {
+            cpu.shifted_ri = data.value + cpu.program_offset;
+          }
+        }},
+        {"jis.b",   command_type::LABEL8, false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
+          if (cpu.flags.sign) {
+            cpu.shifted_ri = data.value + cpu.program_offset;
+          }
+        }},
+        {"jus.b",   command_type::LABEL8, false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
+          if (!cpu.flags.sign) {
+            cpu.shifted_ri = data.value + cpu.program_offset;
+          }
+        }},
+        {"jio.b",   command_type::LABEL8, false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
+          if (cpu.flags.overflow) {
+            cpu.shifted_ri = data.value + cpu.program_offset;
+          }
+        }},
+        {"juo.b",   command_type::LABEL8, false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
+          if (!cpu.flags.overflow) {
+            cpu.shifted_ri = data.value + cpu.program_offset;
+          }
+        }},
+        {"call.w",  command_type::LABEL16, false, control_flow::CALL, [](CPU& cpu, const CommandData& data) {
+          cpu.push_on_stack(cpu.shifted_ri);
+          cpu.shifted_ri = data.value + cpu.program_offset;
+        }},
+        {"jmp.w",   command_type::LABEL16, false, control_flow::JUMP, [](CPU& cpu, const CommandData& data) {
+          cpu.shifted_ri = data.value + cpu.program_offset;
+        }},
+        {"jiz.w",   command_type::LABEL16, false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
+          if (cpu.flags.zero) {
+            cpu.shifted_ri = data.value + cpu.program_offset;
+          }
+        }},
+        {"juz.w",   command_type::LABEL16, false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
+          if (!cpu.flags.zero) {
+            cpu.shifted_ri = data.value + cpu.program_offset;
+          }
+        }},
+        {"jis.w",   command_type::LABEL16, false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
+          if (cpu.flags.sign) {
+            cpu.shifted_ri = data.value + cpu.program_offset;
+          }
+        }},
+        {"jus.w",   command_type::LABEL16, false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
+          if (!cpu.flags.sign) {
+            cpu.shifted_ri = data.value + cpu.program_offset;
+          }
+        }},
+        {"jio.w",   command_type::LABEL16, false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
+          if (cpu.flags.overflow) {
+            cpu.shifted_ri = data.value + cpu.program_offset;
+          }
+        }},
+        {"juo.w",   command_type::LABEL16, false, control_flow::BRANCH, [](CPU& cpu, const CommandData& data) {
+          if (!cpu.flags.overflow) {
+            cpu.shifted_ri = data.value + cpu.program_offset;
+          }
+        }},
     };
\ No newline at end of file
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <charconv>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "cpu.h"
+#include "symbols.h"
+
+// Decodes code into a flat array of instructions and renders them as assembly text
+
+class DisassembleError : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+constexpr uint32_t NO_TARGET = static_cast<uint32_t>(-1);
+
+struct Instruction {
+  uint32_t offset{0};
+  uint32_t size{0};
+  // Program offset a LABEL-type command refers to, NO_TARGET for the others
+  uint32_t target{NO_TARGET};
+  uint8_t command{0};
+
+  const Command& get_command() const {
+    return CPU::commands[command];
+  }
+};
+
+
+namespace decoder_detail {
+
+inline size_t operand_bytes(command_type type, size_t& registers) {
+  switch (type) {
+    case command_type::SIMPLE:
+      registers = 0;
+      return 0;
+    case command_type::REG:
+      registers = 1;
+      return 0;
+    case command_type::REGREG:
+    case command_type::VECVEC:
+    case command_type::VECREG:
+    case command_type::REGVEC:
+      registers = 2;
+      return 0;
+    case command_type::REGREGREG:
+      registers = 3;
+      return 0;
+    case command_type::REGVAL:
+      registers = 1;
+      return 4;
+    case command_type::REGVAL8:
+      registers = 1;
+      return 1;
+    case command_type::REGVAL16:
+      registers = 1;
+      return 2;
+    case command_type::LABEL:
+      registers = 0;
+      return 4;
+    case command_type::LABEL8:
+      registers = 0;
+      return 1;
+    case command_type::LABEL16:
+      registers = 0;
+      return 2;
+  }
+  registers = 0;
+  return 0;
+}
+
+// Little-endian value of `size` bytes, sign-extended unless it is 4 bytes long
+inline uint32_t read_operand(const uint8_t* bytes, size_t size) {
+  switch (size) {
+    case 1:
+      return static_cast<uint32_t>(static_cast<int8_t>(bytes[0]));
+    case 2:
+      return static_cast<uint32_t>(static_cast<int16_t>(bytes[0] | (bytes[1] << 8)));
+    default:
+      return static_cast<uint32_t>(bytes[0]) | (static_cast<uint32_t>(bytes[1]) << 8) |
+             (static_cast<uint32_t>(bytes[2]) << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+  }
+}
+
+inline void append_number(std::string& out, int64_t value) {
+  char buffer[24];
+  auto res = std::to_chars(buffer, buffer + sizeof(buffer), value);
+  out.append(buffer, res.ptr);
+}
+
+}
+
+
+// Decodes the instruction at the start of `bytes`, or returns false if fewer than its size are available
+inline bool decode_instruction(const uint8_t* bytes, size_t available, uint32_t offset, Instruction& instruction) {
+  using namespace decoder_detail;
+  instruction.offset = offset;
+  instruction.command = bytes[0];
+  if (instruction.command >= CPU::commands.size()) {
+    throw DisassembleError("Invalid command at offset " + std::to_string(offset));
+  }
+  command_type type = instruction.get_command().type;
+  size_t registers = 0;
+  size_t operand = operand_bytes(type, registers);
+  instruction.size = static_cast<uint32_t>(1 + registers + operand);
+  if (instruction.size > available) {
+    return false;
+  }
+  instruction.target = NO_TARGET;
+  if (type == command_type::LABEL) {
+    instruction.target = read_operand(bytes + 1, 4);
+  } else if (type == command_type::LABEL8 || type == command_type::LABEL16) {
+    instruction.target = read_operand(bytes + 1, operand) + instruction.offset + instruction.size;
+  }
+  return true;
+}
+
+inline std::vector<Instruction> decode(const std::vector<uint8_t>& program) {
+  std::vector<Instruction> instructions;
+  instructions.reserve(program.size() / 3);
+  size_t pos = 0;
+  while (pos < program.size()) {
+    Instruction instruction;
+    if (!decode_instruction(&program[pos], program.size() - pos, static_cast<uint32_t>(pos), instruction)) {
+      throw DisassembleError("Unexpected end of file");
+    }
+    instructions.push_back(instruction);
+    pos += instruction.size;
+  }
+  return instructions;
+}
+
+
+// Labels are named after the symbol at their offset when there is one. Names must stay unique for the
+// listing to reassemble, so a name seen twice (locals of different linked objects) is used only once.
+class LabelNames {
+
+ public:
+  explicit LabelNames(const SymbolTable& symbols) {
+    std::set<std::string> used;
+    for (const auto& symbol : symbols.get_symbols()) {
+      auto key = std::make_pair(symbol.section, symbol.offset);
+      if (!names.count(key) && used.insert(symbol.name).second) {
+        names[key] = symbol.name;
+      }
+    }
+  }
+
+  std::string get(section_kind section, uint32_t offset, const std::string& fallback) const {
+    auto it = names.find(std::make_pair(section, offset));
+    return it != names.end() ? it->second : fallback;
+  }
+
+  void append(std::string& out, uint32_t offset) const {
+    auto it = names.find(std::make_pair(section_kind::CODE, offset));
+    if (it != names.end()) {
+      out += it->second;
+    } else {
+      out += "@l";
+      decoder_detail::append_number(out, offset);
+    }
+  }
+
+  bool has(section_kind section, uint32_t offset) const {
+    return names.count(std::make_pair(section, offset)) != 0;
+  }
+
+ private:
+  std::map<std::pair<section_kind, uint32_t>, std::string> names{};
+};
+
+
+// Appends the text of an instruction without its label operand, which depends on the listing;
+// `code` points to the instruction
+inline void append_instruction(std::string& out, const uint8_t* code, const Instruction& instruction) {
+  using namespace decoder_detail;
+  const Command& command = instruction.get_command();
+  out += command.mnemonic;
+  size_t registers = 0;
+  size_t operand = operand_bytes(command.type, registers);
+  const uint8_t* bytes = code + 1;
+  for (size_t i = 0; i < registers; ++i) {
+    bool vector = command.type == command_type::VECVEC || (command.type == command_type::VECREG && i == 0) ||
+                  (command.type == command_type::REGVEC && i == 1);
+    if (vector) {
+      out += " V";
+      append_number(out, bytes[i]);
+    } else if (bytes[i] == REG_STACK) {
+      out += " RS";
+    } else if (bytes[i] == REG_INSTRUCTION) {
+      out += " RI";
+    } else {
+      out += " R";
+      append_number(out, bytes[i]);
+    }
+  }
+  if (operand && instruction.target == NO_TARGET) {
+    out += ' ';
+    uint32_t value = read_operand(bytes + registers, operand);
+    // Compact immediates are shown signed, 32-bit ones as they are stored
+    append_number(out, operand == 4 ? static_cast<int64_t>(value) : static_cast<int32_t>(value));
+  }
+}
+
+inline void append_instruction(std::string& out, const std::vector<uint8_t>& program, const Instruction& instruction) {
+  append_instruction(out, &program[instruction.offset], instruction);
+}
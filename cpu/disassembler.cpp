@@ -1,113 +1,301 @@
+#include <functional>
 #include <iostream>
 #include <fstream>
-#include <map>
-#include <set>
-#include "cpu.h"
+#include <queue>
+#include <unordered_set>
+#include "cfg.h"
+#include "decoder.h"
+#include "image.h"
+#include "symbols.h"
 
 
- class DisassembleError: public std::runtime_error {
-  using std::runtime_error::runtime_error;
-};
-
+bool is_covered(const std::vector<uint8_t> &coverage, size_t offset) {
+  return offset / 8 < coverage.size() && (coverage[offset / 8] >> (offset % 8) & 1);
+}
 
-std::string read_register(const std::vector<uint8_t> &program, size_t &pos) {
-  if (pos >= program.size()) {
-    throw DisassembleError("Unexpected end of file");
+// Linear listing into one buffer; labels are the jump targets that start an instruction
+std::string disassemble(const std::vector<uint8_t> &program, const std::vector<Instruction> &instructions,
+                        const std::vector<uint8_t> &coverage, const LabelNames &names) {
+  std::vector<bool> starts(program.size() + 1, false);
+  std::vector<bool> targets(program.size() + 1, false);
+  for (const auto &instruction : instructions) {
+    starts[instruction.offset] = true;
   }
-  uint8_t reg = program[pos++];
-  if (reg == REG_STACK) {
-    return " RS";
+  for (const auto &instruction : instructions) {
+    if (instruction.target < targets.size()) {
+      targets[instruction.target] = true;
+    }
   }
-  if (reg == REG_INSTRUCTION) {
-    return " RI";
+  auto end = static_cast<uint32_t>(program.size());
+  std::string end_name = names.get(section_kind::CODE, end, "@end");
+  std::string out_string;
+  out_string.reserve(program.size() * 8);
+  bool block_covered = false;
+  bool falls_through = false;
+  size_t blocks = 0, blocks_covered = 0;
+  for (const auto &instruction : instructions) {
+    bool labeled = targets[instruction.offset];
+    if (instruction.offset == 0 || labeled || !falls_through) {
+      // A block entered by a jump, call, return or branch has its own bit, otherwise it was reached
+      // by falling through the previous one
+      block_covered = is_covered(coverage, instruction.offset) || (falls_through && block_covered);
+      ++blocks;
+      blocks_covered += block_covered;
+    }
+    falls_through = instruction.get_command().flow == control_flow::NONE;
+    if (labeled) {
+      names.append(out_string, instruction.offset);
+      out_string += '\n';
+    }
+    append_instruction(out_string, program, instruction);
+    if (instruction.target != NO_TARGET) {
+      out_string += ' ';
+      if (instruction.target < end && starts[instruction.target]) {
+        names.append(out_string, instruction.target);
+      } else if (instruction.target == end) {
+        out_string += end_name;
+      } else {
+        out_string += std::to_string(instruction.target);
+      }
+    }
+    if (!coverage.empty() && !block_covered) {
+      out_string += "  ; not covered";
+    }
+    out_string += '\n';
   }
-  return " R" + std::to_string(reg);
-}
-
-uint32_t get_value(const std::vector<uint8_t> &program, size_t &pos) {
-  if (pos + 4 > program.size()) {
-    throw DisassembleError("Unexpected end of file");
+  if (targets[end]) {
+    out_string += end_name + "\n";
   }
-  uint32_t value = static_cast<uint32_t>(program[pos]) | (static_cast<uint32_t>(program[pos + 1]) << 8) |
-                   (static_cast<uint32_t>(program[pos + 2]) << 16) | (static_cast<uint32_t>(program[pos + 3]) << 24);
-  pos += 4;
-  return value;
+  if (!coverage.empty()) {
+    out_string += "; coverage: " + std::to_string(blocks_covered) + " of " + std::to_string(blocks) + " blocks\n";
+  }
+  return out_string;
 }
 
-std::string read_value(const std::vector<uint8_t> &program, size_t &pos) {
-  return " " + std::to_string(get_value(program, pos));
+
+// Data sections come out as `.byte` lines, so the listing reassembles to the same image
+std::string disassemble_data(const Image &image, section_kind section, const LabelNames &names) {
+  constexpr size_t BYTES_PER_LINE = 16;
+  const std::vector<uint8_t> &data = section == section_kind::RODATA ? image.rodata : image.data;
+  std::string out_string = section == section_kind::RODATA ? ".rodata\n" : ".data\n";
+  size_t line_bytes = 0;
+  for (size_t pos = 0; pos < data.size(); ++pos) {
+    uint32_t address = image.address(section, static_cast<uint32_t>(pos));
+    if (names.has(section, address)) {
+      out_string += (line_bytes ? "\n" : "") + names.get(section, address, "") + "\n";
+      line_bytes = 0;
+    }
+    out_string += (line_bytes ? " " : ".byte ") + std::to_string(data[pos]);
+    if (++line_bytes == BYTES_PER_LINE || pos + 1 == data.size()) {
+      out_string += "\n";
+      line_bytes = 0;
+    }
+  }
+  return out_string;
 }
 
 
-std::string disassemble(const std::vector<uint8_t> &program) {
-  size_t pos = 0;
-  std::map<uint32_t, std::string> output{};
-  std::set<uint32_t> labels;
-  std::map<uint32_t, uint32_t> labels_wanted;
-  while(pos < program.size()) {
-    uint8_t command = program[pos++];
-    if (command >= CPU::commands.size()) {
-      throw DisassembleError("Invalid command at offset " + std::to_string(pos - 1));
-    }
-    std::string &line = output[pos - 1];
-    line += CPU::commands[command].mnemonic;
-    uint32_t label_pos = 0;
-    switch(CPU::commands[command].type) {
-      case command_type::REGREG:
-        line += read_register(program, pos);
-      case command_type::REG:
-        line += read_register(program, pos);
-        break;
-      case command_type::REGVAL:
-        line += read_register(program, pos);
-        line += read_value(program, pos);
-        break;
-      case command_type::LABEL:
-        label_pos = get_value(program, pos);
-        labels.insert(label_pos);
-        labels_wanted[pos - 5] = label_pos;
-      case command_type::SIMPLE:
-        ;
+// Listing of an image read from `in` as it arrives. A label can only be printed before the instruction it
+// names when a jump to it came first, so forward targets become labels, and so does every symbol, while
+// other backward targets stay numbers. Memory is bounded by the labels rather than the program.
+void disassemble_stream(std::istream &in, std::ostream &out, const LabelNames &names) {
+  constexpr size_t CHUNK = 1 << 16;
+  std::vector<uint8_t> buffer(4);
+  in.read(reinterpret_cast<char *>(buffer.data()), 4);
+  buffer.resize(static_cast<size_t>(in.gcount()));
+  if (is_streamed_image(buffer)) {
+    throw DisassembleError("Streamed images are patched at the end; disassemble them without --stream");
+  }
+  if (is_sectioned_image(buffer)) {
+    // Data sections are small next to code and are listed whole
+    Image image;
+    buffer.resize(image_detail::HEADER_SIZE);
+    in.read(reinterpret_cast<char *>(buffer.data() + 4), image_detail::HEADER_SIZE - 4);
+    image.rodata.resize(image_detail::get_uint32(buffer, 4));
+    image.data.resize(image_detail::get_uint32(buffer, 8));
+    in.read(reinterpret_cast<char *>(image.rodata.data()), static_cast<std::streamsize>(image.rodata.size()));
+    in.read(reinterpret_cast<char *>(image.data.data()), static_cast<std::streamsize>(image.data.size()));
+    if (!in) {
+      throw ImageError("Truncated image");
     }
+    out << disassemble_data(image, section_kind::RODATA, names) << disassemble_data(image, section_kind::DATA, names)
+        << ".code\n";
+    buffer.clear();
   }
+
+  std::priority_queue<uint32_t, std::vector<uint32_t>, std::greater<uint32_t>> forward;
+  std::unordered_set<uint32_t> labeled;
   std::string out_string;
-  bool end_label_needed = false;
-  for(const auto &p : output) {
-    if (labels.count(p.first)) {
-      out_string += "@l" + std::to_string(p.first) + "\n";
-    }
-    out_string += p.second;
-    if (labels_wanted.count(p.first)) {
-      if (output.count(labels_wanted[p.first])) {
-        out_string += " @l" + std::to_string(labels_wanted[p.first]);
-      } else if(labels_wanted[p.first] == pos) {
-        out_string += " @end";
-        end_label_needed = true;
-      } else {
-        out_string += " " + std::to_string(labels_wanted[p.first]);
+  uint32_t offset = 0;
+  size_t start = 0;
+  while (true) {
+    buffer.erase(buffer.begin(), buffer.begin() + static_cast<ptrdiff_t>(start));
+    start = 0;
+    size_t kept = buffer.size();
+    buffer.resize(kept + CHUNK);
+    in.read(reinterpret_cast<char *>(buffer.data() + kept), CHUNK);
+    buffer.resize(kept + static_cast<size_t>(in.gcount()));
+    Instruction instruction;
+    while (start < buffer.size() && decode_instruction(&buffer[start], buffer.size() - start, offset, instruction)) {
+      if (!forward.empty() && forward.top() < offset) {
+        throw DisassembleError("Jump into the middle of an instruction at offset " + std::to_string(forward.top()));
+      }
+      bool targeted = !forward.empty() && forward.top() == offset;
+      while (!forward.empty() && forward.top() == offset) {
+        forward.pop();
       }
+      if (targeted || names.has(section_kind::CODE, offset)) {
+        labeled.insert(offset);
+        names.append(out_string, offset);
+        out_string += '\n';
+      }
+      append_instruction(out_string, &buffer[start], instruction);
+      if (instruction.target != NO_TARGET) {
+        out_string += ' ';
+        if (instruction.target > offset) {
+          forward.push(instruction.target);
+          names.append(out_string, instruction.target);
+        } else if (labeled.count(instruction.target)) {
+          names.append(out_string, instruction.target);
+        } else {
+          out_string += std::to_string(instruction.target);
+        }
+      }
+      out_string += '\n';
+      start += instruction.size;
+      offset += instruction.size;
+    }
+    if (out_string.size() >= CHUNK) {
+      out << out_string;
+      out_string.clear();
     }
+    if (!in) {
+      break;
+    }
+  }
+  if (start < buffer.size()) {
+    throw DisassembleError("Unexpected end of file");
+  }
+  // A jump to the end of the program is the only forward one left
+  if (!forward.empty() && forward.top() == offset) {
+    names.append(out_string, offset);
     out_string += '\n';
+    while (!forward.empty() && forward.top() == offset) {
+      forward.pop();
+    }
   }
-  if (end_label_needed) {
-    out_string += "@end\n";
+  if (!forward.empty()) {
+    throw DisassembleError("Jump past the end of the program to offset " + std::to_string(forward.top()));
   }
-  return out_string;
+  out << out_string;
 }
 
 
+bool read_file(const char* filename, std::vector<uint8_t> &data) {
+  std::ifstream infile(filename, std::ifstream::binary | std::ifstream::in);
+  if (!infile.is_open()) {
+    return false;
+  }
+  data.assign(std::istreambuf_iterator<char>(infile), std::istreambuf_iterator<char>());
+  return true;
+}
 
 int main(int argc, char** argv) {
-  if (argc <= 1) {
+  const char* filename = nullptr;
+  bool cfg = false;
+  bool dot = false;
+  bool stream = false;
+  std::vector<uint8_t> coverage;
+  SymbolTable symbols;
+  for (int i = 1; i < argc; ++i) {
+    if (std::string(argv[i]) == "--symbols") {
+      std::vector<uint8_t> table;
+      if (++i == argc || !read_file(argv[i], table)) {
+        std::cerr << "Error: symbol table file required" << std::endl;
+        return 1;
+      }
+      try {
+        symbols = read_symbols(table);
+      } catch (const SymbolError &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+      }
+      continue;
+    }
+    if (std::string(argv[i]) == "--cfg") {
+      cfg = true;
+      continue;
+    }
+    if (std::string(argv[i]) == "--dot") {
+      dot = true;
+      continue;
+    }
+    if (std::string(argv[i]) == "--stream") {
+      stream = true;
+      continue;
+    }
+    if (std::string(argv[i]) != "--coverage") {
+      filename = argv[i];
+      continue;
+    }
+    // Coverage of several runs is merged
+    std::vector<uint8_t> run;
+    if (++i == argc || !read_file(argv[i], run)) {
+      std::cerr << "Error: coverage file required" << std::endl;
+      return 1;
+    }
+    coverage.resize(std::max(coverage.size(), run.size()));
+    for (size_t j = 0; j < run.size(); ++j) {
+      coverage[j] |= run[j];
+    }
+  }
+  if (stream) {
+    // Reads the file, or stdin without one
+    if (cfg || dot || !coverage.empty()) {
+      std::cerr << "--cfg, --dot and --coverage need the whole program and cannot be used with --stream" << std::endl;
+      return 1;
+    }
+    std::ifstream infile;
+    if (filename) {
+      infile.open(filename, std::ifstream::binary | std::ifstream::in);
+      if (!infile.is_open()) {
+        std::cerr << "Error: no such file" << std::endl;
+        return 1;
+      }
+    }
+    try {
+      disassemble_stream(filename ? infile : std::cin, std::cout, LabelNames(symbols));
+    } catch (const std::runtime_error &e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+  if (!filename) {
     std::cerr << "Filename required" << std::endl;
     return 1;
   }
-  std::ifstream infile(argv[1], std::ifstream::binary | std::ifstream::in);
-  if (!infile.is_open()) {
+  std::vector<uint8_t> bytes;
+  if (!read_file(filename, bytes)) {
     std::cerr << "Error: no such file" << std::endl;
     return 1;
   }
-  std::vector<uint8_t> program((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
-  std::string assembly = disassemble(program);
-  std::cout << assembly;
+  try {
+    Image image = read_image(bytes);
+    LabelNames names(symbols);
+    auto instructions = decode(image.code);
+    if (cfg || dot) {
+      ControlFlowGraph graph(instructions);
+      std::cout << (dot ? graph.to_dot(image.code, names) : graph.describe(names));
+      return 0;
+    }
+    if (!image.rodata.empty() || !image.data.empty()) {
+      std::cout << disassemble_data(image, section_kind::RODATA, names)
+                << disassemble_data(image, section_kind::DATA, names) << ".code\n";
+    }
+    std::cout << disassemble(image.code, instructions, coverage, names);
+  } catch (const std::runtime_error &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
 }
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// An image is either bare code, or a header followed by its sections when it has data.
+// Numbers are little-endian.
+//
+//   0xff "IMG" (0xff is never a command, so bare code cannot start with it)
+//   rodata size, data size
+//   rodata, data, code
+//
+// The CPU installs rodata at address 0 and makes it read-only, data follows at the next multiple of
+// DATA_ALIGNMENT, and code goes to the end of memory as before. Labels in data sections are therefore
+// absolute addresses, while code labels stay program offsets.
+//
+// A streamed image is written by `assembler --stream` while the source is still being read. Sections come
+// in pieces, and operands that refer to labels declared later are patched by the fixups that follow them.
+//
+//   0xff "STM"
+//   records: kind (1 byte), payload size, payload
+//     CODE, RODATA, DATA: bytes appended to the section
+//     FIXUPS: section (1 byte), operand size (1 byte), position, value; repeated
+//     END: empty, the last record
+
+constexpr uint32_t DATA_ALIGNMENT = 16;
+
+enum class section_kind : uint8_t {
+  CODE, RODATA, DATA
+};
+
+// The first three match section_kind
+enum class stream_record : uint8_t {
+  CODE, RODATA, DATA, FIXUPS, END
+};
+
+class ImageError : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+struct Image {
+  std::vector<uint8_t> rodata{};
+  std::vector<uint8_t> data{};
+  std::vector<uint8_t> code{};
+
+  std::vector<uint8_t>& section(section_kind kind) {
+    return kind == section_kind::CODE ? code : kind == section_kind::RODATA ? rodata : data;
+  }
+
+  uint32_t data_address() const {
+    return align_up(static_cast<uint32_t>(rodata.size()), DATA_ALIGNMENT);
+  }
+
+  // Address of a data section offset; code offsets are left as they are
+  uint32_t address(section_kind kind, uint32_t offset) const {
+    return kind == section_kind::DATA ? data_address() + offset : offset;
+  }
+
+  static uint32_t align_up(uint32_t value, uint32_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+  }
+};
+
+
+namespace image_detail {
+
+inline void put_uint32(std::vector<uint8_t>& out, uint32_t num) {
+  out.push_back(static_cast<uint8_t>(num));
+  out.push_back(static_cast<uint8_t>(num >> 8));
+  out.push_back(static_cast<uint8_t>(num >> 16));
+  out.push_back(static_cast<uint8_t>(num >> 24));
+}
+
+inline uint32_t get_uint32(const std::vector<uint8_t>& data, size_t pos) {
+  return static_cast<uint32_t>(data[pos]) | (static_cast<uint32_t>(data[pos + 1]) << 8) |
+         (static_cast<uint32_t>(data[pos + 2]) << 16) | (static_cast<uint32_t>(data[pos + 3]) << 24);
+}
+
+constexpr size_t HEADER_SIZE = 12;
+constexpr size_t RECORD_HEADER_SIZE = 5;
+constexpr size_t STREAM_FIXUP_SIZE = 10;
+
+inline Image read_streamed_image(const std::vector<uint8_t>& bytes) {
+  Image image;
+  size_t pos = 4;
+  while (true) {
+    if (pos + RECORD_HEADER_SIZE > bytes.size()) {
+      throw ImageError("Truncated image");
+    }
+    auto kind = static_cast<stream_record>(bytes[pos]);
+    size_t size = get_uint32(bytes, pos + 1);
+    pos += RECORD_HEADER_SIZE;
+    if (size > bytes.size() - pos) {
+      throw ImageError("Truncated image");
+    }
+    auto payload = bytes.begin() + static_cast<ptrdiff_t>(pos);
+    switch (kind) {
+      case stream_record::CODE:
+      case stream_record::RODATA:
+      case stream_record::DATA: {
+        std::vector<uint8_t>& section = image.section(static_cast<section_kind>(kind));
+        section.insert(section.end(), payload, payload + static_cast<ptrdiff_t>(size));
+        break;
+      }
+      case stream_record::FIXUPS:
+        if (size % STREAM_FIXUP_SIZE) {
+          throw ImageError("Invalid fixup record");
+        }
+        for (size_t fixup = pos; fixup < pos + size; fixup += STREAM_FIXUP_SIZE) {
+          size_t operand = bytes[fixup + 1];
+          size_t position = get_uint32(bytes, fixup + 2);
+          uint32_t value = get_uint32(bytes, fixup + 6);
+          if (bytes[fixup] > static_cast<uint8_t>(section_kind::DATA) || (operand != 1 && operand != 2 && operand != 4)) {
+            throw ImageError("Invalid fixup record");
+          }
+          std::vector<uint8_t>& section = image.section(static_cast<section_kind>(bytes[fixup]));
+          if (position + operand > section.size()) {
+            throw ImageError("Fixup outside of its section");
+          }
+          for (size_t i = 0; i < operand; ++i) {
+            section[position + i] = static_cast<uint8_t>(value >> (8 * i));
+          }
+        }
+        break;
+      case stream_record::END:
+        if (pos != bytes.size()) {
+          throw ImageError("Data after the end of the image");
+        }
+        return image;
+      default:
+        throw ImageError("Invalid record");
+    }
+    pos += size;
+  }
+}
+
+}
+
+
+inline bool is_sectioned_image(const std::vector<uint8_t>& bytes) {
+  return bytes.size() >= 4 && bytes[0] == 0xff && bytes[1] == 'I' && bytes[2] == 'M' && bytes[3] == 'G';
+}
+
+inline bool is_streamed_image(const std::vector<uint8_t>& bytes) {
+  return bytes.size() >= 4 && bytes[0] == 0xff && bytes[1] == 'S' && bytes[2] == 'T' && bytes[3] == 'M';
+}
+
+// Images without data are written as bare code, which every version of the CPU runs
+inline std::vector<uint8_t> write_image(const Image& image) {
+  using namespace image_detail;
+  if (image.rodata.empty() && image.data.empty()) {
+    return image.code;
+  }
+  std::vector<uint8_t> out{0xff, 'I', 'M', 'G'};
+  put_uint32(out, static_cast<uint32_t>(image.rodata.size()));
+  put_uint32(out, static_cast<uint32_t>(image.data.size()));
+  out.insert(out.end(), image.rodata.begin(), image.rodata.end());
+  out.insert(out.end(), image.data.begin(), image.data.end());
+  out.insert(out.end(), image.code.begin(), image.code.end());
+  return out;
+}
+
+inline Image read_image(const std::vector<uint8_t>& bytes) {
+  using namespace image_detail;
+  if (is_streamed_image(bytes)) {
+    return read_streamed_image(bytes);
+  }
+  Image image;
+  if (!is_sectioned_image(bytes)) {
+    image.code = bytes;
+    return image;
+  }
+  if (bytes.size() < HEADER_SIZE) {
+    throw ImageError("Truncated image");
+  }
+  size_t rodata_size = get_uint32(bytes, 4);
+  size_t data_size = get_uint32(bytes, 8);
+  if (HEADER_SIZE + rodata_size + data_size > bytes.size()) {
+    throw ImageError("Truncated image");
+  }
+  auto rodata = bytes.begin() + static_cast<ptrdiff_t>(HEADER_SIZE);
+  auto data = rodata + static_cast<ptrdiff_t>(rodata_size);
+  auto code = data + static_cast<ptrdiff_t>(data_size);
+  image.rodata.assign(rodata, data);
+  image.data.assign(data, code);
+  image.code.assign(code, bytes.end());
+  return image;
+}
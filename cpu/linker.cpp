@@ -0,0 +1,107 @@
+#include <array>
+#include <iostream>
+#include <fstream>
+#include <map>
+#include "object.h"
+#include "symbols.h"
+
+class LinkError : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+
+// Objects are placed one after another in command line order, so the first one holds the entry point.
+// Each section of an object starts aligned, so that `.align` in the object holds in the image.
+// Local symbols of different objects may share a name in `symbols`.
+std::vector<uint8_t> link(const std::vector<ObjectFile>& objects, SymbolTable* symbols = nullptr) {
+  const section_kind sections[] = {section_kind::CODE, section_kind::RODATA, section_kind::DATA};
+  std::vector<std::array<uint32_t, 3>> bases(objects.size());
+  Image image;
+  for (size_t i = 0; i < objects.size(); ++i) {
+    for (section_kind section : sections) {
+      std::vector<uint8_t>& out = image.section(section);
+      if (section != section_kind::CODE) {
+        out.resize(Image::align_up(static_cast<uint32_t>(out.size()), DATA_ALIGNMENT), 0);
+      }
+      bases[i][static_cast<size_t>(section)] = static_cast<uint32_t>(out.size());
+      out.insert(out.end(), objects[i].section(section).begin(), objects[i].section(section).end());
+    }
+  }
+
+  std::map<std::string, uint32_t> globals{{IMAGE_END_SYMBOL, static_cast<uint32_t>(image.code.size())}};
+  std::vector<std::map<std::string, uint32_t>> locals(objects.size());
+  std::vector<Symbol> linked;
+  for (size_t i = 0; i < objects.size(); ++i) {
+    for (const auto& symbol : objects[i].symbols) {
+      uint32_t address = image.address(symbol.section, bases[i][static_cast<size_t>(symbol.section)] + symbol.offset);
+      locals[i][symbol.name] = address;
+      linked.push_back({symbol.section, address, symbol.name});
+      if (symbol.global && !globals.emplace(symbol.name, address).second) {
+        throw LinkError("Symbol defined more than once: " + symbol.name);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < objects.size(); ++i) {
+    for (const auto& relocation : objects[i].relocations) {
+      auto it = locals[i].find(relocation.symbol);
+      if (it == locals[i].end()) {
+        it = globals.find(relocation.symbol);
+        if (it == globals.end()) {
+          throw LinkError("Undefined symbol: " + relocation.symbol);
+        }
+      }
+      std::vector<uint8_t>& out = image.section(relocation.section);
+      uint32_t position = bases[i][static_cast<size_t>(relocation.section)] + relocation.position;
+      out[position] = static_cast<uint8_t>(it->second);
+      out[position + 1] = static_cast<uint8_t>(it->second >> 8);
+      out[position + 2] = static_cast<uint8_t>(it->second >> 16);
+      out[position + 3] = static_cast<uint8_t>(it->second >> 24);
+    }
+  }
+  if (symbols) {
+    *symbols = SymbolTable(std::move(linked));
+  }
+  return write_image(image);
+}
+
+
+int main(int argc, char** argv) {
+  if (argc <= 1) {
+    std::cerr << "Filename required" << std::endl;
+    return 1;
+  }
+  std::vector<ObjectFile> objects;
+  const char* symbols_filename = nullptr;
+  try {
+    for (int i = 1; i < argc; ++i) {
+      if (std::string(argv[i]) == "-s") {
+        if (++i == argc) {
+          std::cerr << "Symbol table filename required" << std::endl;
+          return 1;
+        }
+        symbols_filename = argv[i];
+        continue;
+      }
+      std::ifstream infile(argv[i], std::ifstream::binary | std::ifstream::in);
+      if (!infile.is_open()) {
+        std::cerr << "Error: no such file: " << argv[i] << std::endl;
+        return 1;
+      }
+      std::vector<uint8_t> data((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
+      objects.push_back(read_object(data));
+    }
+    SymbolTable symbols;
+    auto image = link(objects, &symbols);
+    if (symbols_filename) {
+      auto table = write_symbols(symbols);
+      std::ofstream outfile(symbols_filename, std::ofstream::binary | std::ofstream::out);
+      outfile.write(reinterpret_cast<const char*>(table.data()), static_cast<std::streamsize>(table.size()));
+    }
+    std::cout.write(reinterpret_cast<const char*>(image.data()), static_cast<std::streamsize>(image.size()));
+  } catch (const std::runtime_error& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
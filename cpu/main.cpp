@@ -1,12 +1,23 @@
+#include <cstdio>
 #include <iostream>
 #include <fstream>
+#include <mutex>
 #include "cpu.h"
 
+constexpr size_t PIPELINE_CHANNEL_CAPACITY = 4096;
+constexpr uint32_t CHANNEL_PREVIOUS = 0;
+constexpr uint32_t CHANNEL_NEXT = 1;
+
+std::mutex input_mutex;
+std::mutex output_mutex;
+
 uint32_t input_func() {
+  std::lock_guard<std::mutex> lock(input_mutex);
   return static_cast<uint32_t>(std::cin.get());
 }
 
 void output_func(uint32_t c) {
+  std::lock_guard<std::mutex> lock(output_mutex);
   std::cout << static_cast<unsigned char>(c);
 }
 
@@ -15,16 +26,136 @@ int main(int argc, char** argv) {
     std::cerr << "Filename required" << std::endl;
     return 1;
   }
-  std::ifstream infile(argv[1]);
-  if (!infile.is_open()) {
-    std::cerr << "Error: no such file" << std::endl;
+  std::vector<std::vector<uint8_t>> programs;
+  std::string coverage_file;
+  SymbolTable symbols;
+  bool has_symbols = false;
+  bool memory_profile = false;
+  std::unique_ptr<CacheModel> cache;
+  for (int i = 1; i < argc; ++i) {
+    if (std::string(argv[i]) == "--memprofile") {
+      memory_profile = true;
+      continue;
+    }
+    if (std::string(argv[i]) == "--cache") {
+      unsigned sets = 0, ways = 0, line_size = 0;
+      if (++i == argc || sscanf(argv[i], "%u:%u:%u", &sets, &ways, &line_size) != 3 || !sets || !ways || !line_size) {
+        std::cerr << "Cache geometry required: SETS:WAYS:LINE_SIZE" << std::endl;
+        return 1;
+      }
+      memory_profile = true;
+      cache = std::make_unique<CacheModel>(sets, ways, line_size);
+      continue;
+    }
+    if (std::string(argv[i]) == "--symbols") {
+      std::ifstream symbols_file;
+      if (++i < argc) {
+        symbols_file.open(argv[i], std::ifstream::binary | std::ifstream::in);
+      }
+      if (!symbols_file.is_open()) {
+        std::cerr << "Symbol table filename required" << std::endl;
+        return 1;
+      }
+      try {
+        symbols = read_symbols({std::istreambuf_iterator<char>(symbols_file), std::istreambuf_iterator<char>()});
+      } catch (const SymbolError& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+      }
+      has_symbols = true;
+      continue;
+    }
+    if (std::string(argv[i]) == "--coverage") {
+      if (++i == argc) {
+        std::cerr << "Coverage filename required" << std::endl;
+        return 1;
+      }
+      coverage_file = argv[i];
+      continue;
+    }
+    std::ifstream infile(argv[i]);
+    if (!infile.is_open()) {
+      std::cerr << "Error: no such file" << std::endl;
+      return 1;
+    }
+    programs.emplace_back((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
+  }
+  if (programs.empty()) {
+    std::cerr << "Filename required" << std::endl;
+    return 1;
+  }
+  if (programs.size() == 1) {
+    CPU cpu(640 * 1024);
+    cpu.set_input_function(input_func);
+    cpu.set_output_function(output_func);
+    cpu.set_coverage_enabled(!coverage_file.empty());
+    MemoryProfiler profiler(std::move(cache));
+    if (memory_profile) {
+      cpu.set_memory_profiler(&profiler);
+    }
+    cpu.set_symbol_table(&symbols);
+    int result = 0;
+    try {
+      cpu.install_program(programs[0]);
+      cpu.run_until_complete();
+    } catch (const CPUError& e) {
+      std::cout.flush();
+      std::cerr << "Error: " << e.what() << " at " << cpu.symbolize(cpu.get_instruction_address()) << std::endl;
+      result = 1;
+    }
+    if (memory_profile) {
+      std::cout.flush();
+      profiler.report(std::cerr, &symbols);
+    }
+    if (!coverage_file.empty()) {
+      std::ofstream outfile(coverage_file, std::ofstream::binary | std::ofstream::out);
+      const auto& coverage = cpu.get_coverage();
+      outfile.write(reinterpret_cast<const char*>(coverage.data()), static_cast<std::streamsize>(coverage.size()));
+    }
+    return result;
+  }
+  if (!coverage_file.empty() || memory_profile || has_symbols) {
+    std::cerr << "Coverage, profiling and symbols are only supported for a single program" << std::endl;
     return 1;
   }
-  std::vector<uint8_t> program((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
-  CPU cpu(640 * 1024);
-  cpu.set_input_function(input_func);
-  cpu.set_output_function(output_func);
-  cpu.install_program(program);
-  cpu.run_until_complete();
-  return 0;
-}
\ No newline at end of file
+
+  // Pipeline: every program runs on its own thread, channel 0 reads from the previous stage,
+  // channel 1 writes to the next one
+  std::vector<std::shared_ptr<Channel>> links;
+  for (size_t i = 0; i + 1 < programs.size(); ++i) {
+    links.push_back(std::make_shared<Channel>(PIPELINE_CHANNEL_CAPACITY));
+  }
+  std::vector<std::thread> threads;
+  std::atomic<int> result{0};
+  for (size_t i = 0; i < programs.size(); ++i) {
+    threads.emplace_back([&, i]() {
+      CPU cpu(640 * 1024);
+      cpu.set_input_function(input_func);
+      cpu.set_output_function(output_func);
+      if (i > 0) {
+        cpu.attach_channel(CHANNEL_PREVIOUS, links[i - 1]);
+      }
+      if (i + 1 < programs.size()) {
+        cpu.attach_channel(CHANNEL_NEXT, links[i]);
+      }
+      try {
+        cpu.install_program(programs[i]);
+        cpu.run_until_complete();
+      } catch (const CPUError& e) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cerr << "Stage " << i + 1 << ": " << e.what() << std::endl;
+        result = 1;
+      }
+      if (i > 0) {
+        links[i - 1]->close();
+      }
+      if (i + 1 < programs.size()) {
+        links[i]->close();
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  return result;
+}
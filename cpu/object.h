@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "image.h"
+
+// Relocatable object produced by `assembler -c` and combined by the linker.
+// All multi-byte numbers are little-endian; strings are stored as a 32-bit length and the bytes.
+//
+//   "NOBJ" version
+//   code size, code, rodata size, rodata, data size, data
+//   symbol count, symbols: flags (1 = global), section, offset in section, name
+//   relocation count, relocations: section, position in section, symbol name
+
+constexpr uint8_t OBJECT_VERSION = 2;
+constexpr uint8_t SYMBOL_GLOBAL = 1;
+
+// Defined by the linker as the size of the linked image, so that `jmp @__image_end` halts the program
+const std::string IMAGE_END_SYMBOL = "@__image_end";
+
+class ObjectError : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+struct ObjectSymbol {
+  std::string name{};
+  uint32_t offset{0};
+  bool global{false};
+  section_kind section{section_kind::CODE};
+};
+
+// The 32-bit value at `position` of `section` is replaced with the address of `symbol`
+struct Relocation {
+  uint32_t position{0};
+  std::string symbol{};
+  section_kind section{section_kind::CODE};
+};
+
+struct ObjectFile {
+  std::vector<uint8_t> code{};
+  std::vector<uint8_t> rodata{};
+  std::vector<uint8_t> data{};
+  std::vector<ObjectSymbol> symbols{};
+  std::vector<Relocation> relocations{};
+
+  const std::vector<uint8_t>& section(section_kind kind) const {
+    return kind == section_kind::CODE ? code : kind == section_kind::RODATA ? rodata : data;
+  }
+};
+
+
+namespace object_detail {
+
+inline void put_uint32(std::vector<uint8_t>& out, uint32_t num) {
+  out.push_back(static_cast<uint8_t>(num));
+  out.push_back(static_cast<uint8_t>(num >> 8));
+  out.push_back(static_cast<uint8_t>(num >> 16));
+  out.push_back(static_cast<uint8_t>(num >> 24));
+}
+
+inline void put_string(std::vector<uint8_t>& out, const std::string& s) {
+  put_uint32(out, static_cast<uint32_t>(s.size()));
+  out.insert(out.end(), s.begin(), s.end());
+}
+
+class Reader {
+
+ public:
+  explicit Reader(const std::vector<uint8_t>& data)
+      : data(data) {
+  }
+
+  uint8_t get_uint8() {
+    need(1);
+    return data[pos++];
+  }
+
+  uint32_t get_uint32() {
+    need(4);
+    uint32_t value = static_cast<uint32_t>(data[pos]) | (static_cast<uint32_t>(data[pos + 1]) << 8) |
+                     (static_cast<uint32_t>(data[pos + 2]) << 16) | (static_cast<uint32_t>(data[pos + 3]) << 24);
+    pos += 4;
+    return value;
+  }
+
+  std::vector<uint8_t> get_bytes(uint32_t size) {
+    need(size);
+    std::vector<uint8_t> res(data.begin() + static_cast<ptrdiff_t>(pos),
+                             data.begin() + static_cast<ptrdiff_t>(pos + size));
+    pos += size;
+    return res;
+  }
+
+  section_kind get_section() {
+    uint8_t section = get_uint8();
+    if (section > static_cast<uint8_t>(section_kind::DATA)) {
+      throw ObjectError("Invalid section");
+    }
+    return static_cast<section_kind>(section);
+  }
+
+  std::string get_string() {
+    auto bytes = get_bytes(get_uint32());
+    return std::string(bytes.begin(), bytes.end());
+  }
+
+ private:
+  void need(size_t size) {
+    if (pos + size > data.size()) {
+      throw ObjectError("Truncated object file");
+    }
+  }
+
+  const std::vector<uint8_t>& data;
+  size_t pos{0};
+};
+
+}
+
+
+inline bool is_object_file(const std::vector<uint8_t>& data) {
+  return data.size() >= 4 && data[0] == 'N' && data[1] == 'O' && data[2] == 'B' && data[3] == 'J';
+}
+
+inline std::vector<uint8_t> write_object(const ObjectFile& object) {
+  using namespace object_detail;
+  std::vector<uint8_t> out{'N', 'O', 'B', 'J', OBJECT_VERSION};
+  for (const auto* section : {&object.code, &object.rodata, &object.data}) {
+    put_uint32(out, static_cast<uint32_t>(section->size()));
+    out.insert(out.end(), section->begin(), section->end());
+  }
+  put_uint32(out, static_cast<uint32_t>(object.symbols.size()));
+  for (const auto& symbol : object.symbols) {
+    out.push_back(symbol.global ? SYMBOL_GLOBAL : 0);
+    out.push_back(static_cast<uint8_t>(symbol.section));
+    put_uint32(out, symbol.offset);
+    put_string(out, symbol.name);
+  }
+  put_uint32(out, static_cast<uint32_t>(object.relocations.size()));
+  for (const auto& relocation : object.relocations) {
+    out.push_back(static_cast<uint8_t>(relocation.section));
+    put_uint32(out, relocation.position);
+    put_string(out, relocation.symbol);
+  }
+  return out;
+}
+
+inline ObjectFile read_object(const std::vector<uint8_t>& data) {
+  using namespace object_detail;
+  if (!is_object_file(data)) {
+    throw ObjectError("Not an object file");
+  }
+  Reader reader(data);
+  reader.get_uint32();
+  if (reader.get_uint8() != OBJECT_VERSION) {
+    throw ObjectError("Unsupported object file version");
+  }
+  ObjectFile object;
+  object.code = reader.get_bytes(reader.get_uint32());
+  object.rodata = reader.get_bytes(reader.get_uint32());
+  object.data = reader.get_bytes(reader.get_uint32());
+  for (uint32_t i = reader.get_uint32(); i > 0; --i) {
+    ObjectSymbol symbol;
+    symbol.global = reader.get_uint8() & SYMBOL_GLOBAL;
+    symbol.section = reader.get_section();
+    symbol.offset = reader.get_uint32();
+    symbol.name = reader.get_string();
+    object.symbols.push_back(std::move(symbol));
+  }
+  for (uint32_t i = reader.get_uint32(); i > 0; --i) {
+    Relocation relocation;
+    relocation.section = reader.get_section();
+    relocation.position = reader.get_uint32();
+    relocation.symbol = reader.get_string();
+    if (static_cast<size_t>(relocation.position) + 4 > object.section(relocation.section).size()) {
+      throw ObjectError("Relocation outside of its section");
+    }
+    object.relocations.push_back(std::move(relocation));
+  }
+  return object;
+}
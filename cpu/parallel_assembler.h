@@ -0,0 +1,143 @@
+#pragma once
+
+#include <string_view>
+#include <vector>
+#include "assembler.h"
+#include "thread_pool.h"
+
+// Parallel parse and encode for very large sources, producing the same output as parse and encode.
+// The source is cut at label lines, so that no statement spans two chunks.
+
+// Smaller inputs are not worth the threads
+constexpr size_t MIN_PARALLEL_SOURCE_CHUNK = 1 << 20;
+constexpr size_t MIN_PARALLEL_STATEMENT_CHUNK = 1 << 15;
+// Several chunks per thread even out the work
+constexpr size_t CHUNKS_PER_THREAD = 4;
+
+namespace parallel_detail {
+
+inline size_t chunk_count(size_t size, size_t min_chunk, const ThreadPool& pool) {
+  return std::max<size_t>(1, std::min(size / min_chunk, pool.size() * CHUNKS_PER_THREAD));
+}
+
+inline std::vector<std::string_view> split_source(std::string_view program, size_t count) {
+  std::vector<std::string_view> chunks;
+  size_t start = 0;
+  for (size_t i = 1; i < count; ++i) {
+    size_t split = program.find("\n@", std::max(start, program.size() / count * i));
+    if (split == std::string_view::npos) {
+      break;
+    }
+    chunks.push_back(program.substr(start, split + 1 - start));
+    start = split + 1;
+  }
+  chunks.push_back(program.substr(start));
+  return chunks;
+}
+
+// What the parser of the next chunk needs to know about this one
+struct ChunkSummary {
+  size_t lines{0};
+  bool switches_section{false};
+  section_kind last_section{section_kind::CODE};
+};
+
+inline bool is_token(std::string_view line, std::string_view token) {
+  return line.substr(0, token.size()) == token &&
+         (line.size() == token.size() || line[token.size()] == ' ' || line[token.size()] == '\t' ||
+          line[token.size()] == ';' || line[token.size()] == '\r');
+}
+
+inline ChunkSummary summarize(std::string_view chunk) {
+  ChunkSummary summary;
+  size_t start = 0;
+  while (start < chunk.size()) {
+    size_t end = std::min(chunk.find('\n', start), chunk.size());
+    std::string_view line = chunk.substr(start, end - start);
+    line.remove_prefix(std::min(line.find_first_not_of(" \t"), line.size()));
+    if (!line.empty() && line[0] == '.') {
+      for (auto section : {section_kind::CODE, section_kind::RODATA, section_kind::DATA}) {
+        if (is_token(line, section == section_kind::CODE ? ".code" : section == section_kind::RODATA ? ".rodata"
+                                                                                                      : ".data")) {
+          summary.switches_section = true;
+          summary.last_section = section;
+        }
+      }
+    }
+    summary.lines += end < chunk.size();
+    start = end + 1;
+  }
+  return summary;
+}
+
+}
+
+
+inline std::vector<Statement> parse(std::string_view program, ThreadPool& pool) {
+  using namespace parallel_detail;
+  auto chunks = split_source(program, chunk_count(program.size(), MIN_PARALLEL_SOURCE_CHUNK, pool));
+  if (chunks.size() == 1) {
+    return parse(program);
+  }
+  std::vector<ChunkSummary> summaries(chunks.size());
+  pool.run(chunks.size(), [&](size_t i) {
+    summaries[i] = summarize(chunks[i]);
+  });
+  std::vector<std::vector<Statement>> parsed(chunks.size());
+  pool.run(chunks.size(), [&](size_t i) {
+    size_t first_line = 0;
+    section_kind section = section_kind::CODE;
+    for (size_t j = 0; j < i; ++j) {
+      first_line += summaries[j].lines;
+      section = summaries[j].switches_section ? summaries[j].last_section : section;
+    }
+    parsed[i] = parse(chunks[i], section, first_line);
+  });
+  std::vector<Statement> statements;
+  size_t total = 0;
+  for (const auto& piece : parsed) {
+    total += piece.size();
+  }
+  statements.reserve(total);
+  for (const auto& piece : parsed) {
+    statements.insert(statements.end(), piece.begin(), piece.end());
+  }
+  return statements;
+}
+
+// Code is encoded in pieces by detached encoders and placed in order; the data sections, which are
+// small, are encoded alongside by one more task
+inline std::vector<uint8_t> encode(const std::vector<Statement>& statements, ThreadPool& pool,
+                                   ObjectFile* object = nullptr, SymbolTable* symbols = nullptr) {
+  using namespace parallel_detail;
+  size_t count = chunk_count(statements.size(), MIN_PARALLEL_STATEMENT_CHUNK, pool);
+  if (count == 1) {
+    return encode(statements, object, symbols);
+  }
+  auto is_code = [](const Statement& statement) {
+    return statement.kind == statement_kind::INSTRUCTION ||
+           (statement.kind == statement_kind::LABEL && statement.section == section_kind::CODE);
+  };
+  Encoder encoder(object);
+  std::vector<Encoder> pieces(count, Encoder(object, true));
+  pool.run(count + 1, [&](size_t i) {
+    if (i == count) {
+      for (const auto& statement : statements) {
+        if (!is_code(statement)) {
+          encoder.add(statement);
+        }
+      }
+      return;
+    }
+    size_t end = statements.size() / count * (i + 1);
+    for (size_t j = statements.size() / count * i; j < (i + 1 == count ? statements.size() : end); ++j) {
+      if (is_code(statements[j])) {
+        pieces[i].add(statements[j]);
+      }
+    }
+  });
+  for (const auto& piece : pieces) {
+    encoder.append(piece);
+  }
+  return encoder.finish(symbols);
+}
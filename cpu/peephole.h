@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <string_view>
+#include <vector>
+#include "assembler.h"
+
+// Label-safe peephole optimizer over parsed statements: no rewrite ever spans a label, and every label
+// is treated as a possible entry point.
+
+namespace peephole_detail {
+
+constexpr size_t NONE = static_cast<size_t>(-1);
+
+inline uint8_t find_command(std::string_view mnemonic) {
+  for (size_t i = 0; i < CPU::commands.size(); ++i) {
+    if (CPU::commands[i].mnemonic == mnemonic) {
+      return static_cast<uint8_t>(i);
+    }
+  }
+  throw std::logic_error("Unknown command");
+}
+
+inline bool is_instruction(const Statement& statement, std::string_view mnemonic) {
+  return statement.kind == statement_kind::INSTRUCTION && statement.get_command().mnemonic == mnemonic;
+}
+
+inline bool is_plain_register(uint8_t reg) {
+  return reg != REG_STACK && reg != REG_INSTRUCTION;
+}
+
+// Writes its first register and has no other effect
+inline bool is_register_load(const Statement& statement) {
+  return (is_instruction(statement, "mov") || is_instruction(statement, "set")) &&
+         is_plain_register(statement.registers[0]) &&
+         (!is_instruction(statement, "mov") || is_plain_register(statement.registers[1]));
+}
+
+inline bool is_label_jump(const Statement& statement) {
+  return statement.kind == statement_kind::INSTRUCTION && statement.get_command().type == command_type::LABEL &&
+         statement.operand.is_label();
+}
+
+// Next instruction executed after `index` when falling through, or NONE if a label comes first
+inline size_t next_adjacent(const std::vector<Statement>& statements, size_t index) {
+  for (size_t i = index + 1; i < statements.size(); ++i) {
+    if (statements[i].kind == statement_kind::LABEL) {
+      return NONE;
+    }
+    if (statements[i].kind == statement_kind::INSTRUCTION) {
+      return i;
+    }
+  }
+  return NONE;
+}
+
+// First instruction at or after a label, across other labels
+inline size_t first_instruction_from(const std::vector<Statement>& statements, size_t index) {
+  for (size_t i = index; i < statements.size(); ++i) {
+    if (statements[i].kind == statement_kind::INSTRUCTION) {
+      return i;
+    }
+  }
+  return NONE;
+}
+
+inline bool erase_removed(std::vector<Statement>& statements, std::vector<bool>& removed) {
+  size_t out = 0;
+  for (size_t i = 0; i < statements.size(); ++i) {
+    if (!removed[i]) {
+      statements[out++] = statements[i];
+    }
+  }
+  bool changed = out != statements.size();
+  statements.resize(out);
+  removed.assign(out, false);
+  return changed;
+}
+
+// jmp/jcc/call to a `jmp @x` goes straight to @x, and jmp to a `ret` becomes ret
+inline bool thread_jumps(std::vector<Statement>& statements) {
+  static const uint8_t ret = find_command("ret");
+  LabelTable targets;
+  for (size_t i = 0; i < statements.size(); ++i) {
+    if (statements[i].kind == statement_kind::LABEL) {
+      targets.insert(statements[i].name, static_cast<uint32_t>(i));
+    }
+  }
+  bool changed = false;
+  std::vector<std::string_view> chain;
+  for (auto& statement : statements) {
+    if (!is_label_jump(statement)) {
+      continue;
+    }
+    chain.assign(1, statement.operand.label);
+    size_t destination = NONE;
+    bool cyclic = false;
+    while (true) {
+      const uint32_t* target = targets.find(chain.back());
+      destination = target ? first_instruction_from(statements, *target) : NONE;
+      if (destination == NONE || !is_instruction(statements[destination], "jmp") ||
+          !is_label_jump(statements[destination])) {
+        break;
+      }
+      std::string_view next = statements[destination].operand.label;
+      if (std::find(chain.begin(), chain.end(), next) != chain.end()) {
+        cyclic = true;
+        break;
+      }
+      chain.push_back(next);
+    }
+    if (cyclic) {
+      continue;
+    }
+    if (destination != NONE && statements[destination].command == ret &&
+        statement.get_command().flow == control_flow::JUMP) {
+      statement.command = ret;
+      statement.operand = Operand{};
+      changed = true;
+    } else if (chain.size() > 1) {
+      statement.operand.label = chain.back();
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// Jumps and branches to the label right after them
+inline void remove_jumps_to_next(const std::vector<Statement>& statements, std::vector<bool>& removed) {
+  for (size_t i = 0; i < statements.size(); ++i) {
+    control_flow flow = statements[i].kind == statement_kind::INSTRUCTION ? statements[i].get_command().flow
+                                                                         : control_flow::NONE;
+    if ((flow != control_flow::JUMP && flow != control_flow::BRANCH) || !is_label_jump(statements[i])) {
+      continue;
+    }
+    for (size_t j = i + 1; j < statements.size() && statements[j].kind != statement_kind::INSTRUCTION; ++j) {
+      if (statements[j].kind == statement_kind::LABEL && statements[j].name == statements[i].operand.label) {
+        removed[i] = true;
+        break;
+      }
+    }
+  }
+}
+
+// Instructions after an unconditional transfer that no label leads to
+inline void remove_unreachable(const std::vector<Statement>& statements, std::vector<bool>& removed) {
+  bool reachable = true;
+  for (size_t i = 0; i < statements.size(); ++i) {
+    if (statements[i].kind == statement_kind::LABEL) {
+      reachable = true;
+    } else if (statements[i].kind == statement_kind::INSTRUCTION) {
+      removed[i] = removed[i] || !reachable;
+      control_flow flow = statements[i].get_command().flow;
+      if (flow == control_flow::JUMP || flow == control_flow::RETURN || flow == control_flow::INDIRECT) {
+        reachable = false;
+      }
+    }
+  }
+}
+
+inline bool simplify_pairs(std::vector<Statement>& statements, std::vector<bool>& removed) {
+  static const uint8_t mov = find_command("mov");
+  bool rewritten = false;
+  for (size_t i = 0; i < statements.size(); ++i) {
+    Statement& first = statements[i];
+    if (first.kind != statement_kind::INSTRUCTION || removed[i]) {
+      continue;
+    }
+    if (is_instruction(first, "mov") && first.registers[0] == first.registers[1] &&
+        is_plain_register(first.registers[0])) {
+      removed[i] = true;
+      continue;
+    }
+    size_t j = next_adjacent(statements, i);
+    if (j == NONE) {
+      continue;
+    }
+    Statement& second = statements[j];
+    if (is_instruction(first, "push") && is_instruction(second, "pop")) {
+      if (first.registers[0] == second.registers[0]) {
+        removed[i] = removed[j] = true;
+      } else if (is_plain_register(first.registers[0]) && is_plain_register(second.registers[0])) {
+        removed[i] = true;
+        second.command = mov;
+        second.registers[1] = first.registers[0];
+        rewritten = true;
+      }
+    } else if (is_register_load(first) && is_register_load(second) && first.registers[0] == second.registers[0] &&
+               !(is_instruction(second, "mov") && second.registers[1] == second.registers[0])) {
+      // The first value is overwritten before it is read
+      removed[i] = true;
+    } else if (is_instruction(first, "mov") && is_instruction(second, "mov") && is_register_load(first) &&
+               is_register_load(second) && second.registers[1] == first.registers[0]) {
+      if (second.registers[0] == first.registers[1]) {
+        // mov Rb Ra; mov Ra Rb
+        removed[j] = true;
+      } else {
+        // mov Rb Ra; mov Rc Rb reads Ra directly
+        second.registers[1] = first.registers[1];
+        rewritten = true;
+      }
+    }
+  }
+  return rewritten;
+}
+
+}
+
+
+// Runs all rewrites until none applies
+inline void optimize(std::vector<Statement>& statements) {
+  using namespace peephole_detail;
+  std::vector<bool> removed(statements.size(), false);
+  bool changed = true;
+  while (changed) {
+    changed = thread_jumps(statements);
+    remove_jumps_to_next(statements, removed);
+    changed = erase_removed(statements, removed) || changed;
+    remove_unreachable(statements, removed);
+    changed = erase_removed(statements, removed) || changed;
+    changed = simplify_pairs(statements, removed) || changed;
+    changed = erase_removed(statements, removed) || changed;
+  }
+}
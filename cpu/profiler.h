@@ -0,0 +1,236 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "symbols.h"
+
+// Set-associative cache with LRU replacement
+class CacheModel {
+
+ public:
+  CacheModel(uint32_t sets, uint32_t ways, uint32_t line_size)
+      : sets(sets), ways(ways), line_size(line_size), tags(static_cast<size_t>(sets) * ways, 0),
+        stamps(static_cast<size_t>(sets) * ways, 0) {
+    if (!sets || !ways || !line_size) {
+      throw std::invalid_argument("Cache geometry must be positive");
+    }
+  }
+
+  bool access(uint32_t addr) {
+    uint32_t line = addr / line_size;
+    size_t base = static_cast<size_t>(line % sets) * ways;
+    size_t victim = base;
+    ++clock;
+    for (size_t i = base; i < base + ways; ++i) {
+      if (stamps[i] && tags[i] == line) {
+        stamps[i] = clock;
+        return true;
+      }
+      if (stamps[i] < stamps[victim]) {
+        victim = i;
+      }
+    }
+    tags[victim] = line;
+    stamps[victim] = clock;
+    return false;
+  }
+
+  uint32_t get_line_size() const {
+    return line_size;
+  }
+
+  std::string describe() const {
+    return std::to_string(sets) + " sets, " + std::to_string(ways) + " ways, " + std::to_string(line_size) +
+           " byte lines";
+  }
+
+ private:
+  uint32_t sets, ways, line_size;
+  std::vector<uint32_t> tags;
+  std::vector<uint64_t> stamps;
+  uint64_t clock{0};
+};
+
+
+// Collects guest data accesses per function (region entered by call) at 4-byte word granularity
+class MemoryProfiler {
+
+ public:
+  explicit MemoryProfiler(std::unique_ptr<CacheModel> cache = nullptr)
+      : cache(std::move(cache)) {
+    call_stack.push_back(0);
+  }
+
+  void record(uint32_t addr, uint32_t size, bool write) {
+    Region& region = regions[call_stack.back()];
+    (write ? region.stores : region.loads) += 1;
+    for (uint32_t word = addr / 4; word <= (addr + (size ? size - 1 : 0)) / 4; ++word) {
+      region.words.insert(word);
+      record_reuse(region, word);
+    }
+    if (cache) {
+      for (uint32_t line = addr / cache->get_line_size();
+           line <= (addr + (size ? size - 1 : 0)) / cache->get_line_size(); ++line) {
+        (cache->access(line * cache->get_line_size()) ? region.cache_hits : region.cache_misses) += 1;
+      }
+    }
+  }
+
+  void record_stack_depth(uint32_t depth) {
+    Region& region = regions[call_stack.back()];
+    if (depth > region.max_stack_depth) {
+      region.max_stack_depth = depth;
+    }
+  }
+
+  void enter(uint32_t offset) {
+    call_stack.push_back(offset);
+  }
+
+  void leave() {
+    if (call_stack.size() > 1) {
+      call_stack.pop_back();
+    }
+  }
+
+  // Regions are named after the symbol of the function if a table is given
+  void report(std::ostream& out, const SymbolTable* symbols = nullptr) const {
+    Region total;
+    for (const auto& p : regions) {
+      std::string name = symbols ? symbols->describe(section_kind::CODE, p.first) : "";
+      print_region(out, name.empty() ? "@l" + std::to_string(p.first) : name, p.second);
+      total.merge(p.second);
+    }
+    print_region(out, "total", total);
+    if (cache) {
+      out << "cache: " << cache->describe() << '\n';
+    }
+    out << "reuse distance histogram (distinct words between accesses):\n";
+    for (size_t i = 0; i < reuse_histogram.size(); ++i) {
+      if (reuse_histogram[i]) {
+        out << "  <" << (1ull << i) << ": " << reuse_histogram[i] << '\n';
+      }
+    }
+    if (cold_accesses) {
+      out << "  cold: " << cold_accesses << '\n';
+    }
+  }
+
+ private:
+  struct Region {
+    uint64_t loads{0};
+    uint64_t stores{0};
+    uint32_t max_stack_depth{0};
+    std::unordered_set<uint32_t> words{};
+    uint64_t reuses{0};
+    uint64_t reuse_distance_sum{0};
+    uint64_t cache_hits{0};
+    uint64_t cache_misses{0};
+
+    void merge(const Region& other) {
+      loads += other.loads;
+      stores += other.stores;
+      max_stack_depth = std::max(max_stack_depth, other.max_stack_depth);
+      words.insert(other.words.begin(), other.words.end());
+      reuses += other.reuses;
+      reuse_distance_sum += other.reuse_distance_sum;
+      cache_hits += other.cache_hits;
+      cache_misses += other.cache_misses;
+    }
+  };
+
+  // Reuse distance is the number of distinct words touched since the previous access to the same word.
+  // Every word keeps a mark at the time of its last access in a Fenwick tree over time, so the distance is
+  // the number of marks after the previous access.
+  void record_reuse(Region& region, uint32_t word) {
+    if (fenwick.size() > MIN_COMPACTED_TIMES && fenwick.size() > 2 * last_access.size()) {
+      compact();
+    }
+    size_t now = fenwick.size();
+    fenwick.push_back(prefix_sum(now - 1) - prefix_sum(now - (now & (~now + 1))));
+    auto it = last_access.find(word);
+    if (it == last_access.end()) {
+      ++cold_accesses;
+      last_access[word] = now;
+    } else {
+      uint64_t distance = prefix_sum(now - 1) - prefix_sum(it->second);
+      add(it->second, -1);
+      it->second = now;
+      ++region.reuses;
+      region.reuse_distance_sum += distance;
+      size_t bucket = 0;
+      while ((1ull << bucket) <= distance) {
+        ++bucket;
+      }
+      if (bucket >= reuse_histogram.size()) {
+        reuse_histogram.resize(bucket + 1);
+      }
+      ++reuse_histogram[bucket];
+    }
+    add(now, 1);
+  }
+
+  // Times without a mark are dropped: the last accesses are renumbered 1, 2, ... in their order, which keeps
+  // the number of marks between any two of them. The tree then holds one time per word ever accessed.
+  void compact() {
+    std::vector<std::pair<size_t, uint32_t>> times;
+    times.reserve(last_access.size());
+    for (const auto& access : last_access) {
+      times.emplace_back(access.second, access.first);
+    }
+    std::sort(times.begin(), times.end());
+    fenwick.assign(times.size() + 1, 0);
+    for (size_t i = 1; i < fenwick.size(); ++i) {
+      last_access[times[i - 1].second] = i;
+      fenwick[i] += 1;
+      size_t parent = i + (i & (~i + 1));
+      if (parent < fenwick.size()) {
+        fenwick[parent] += fenwick[i];
+      }
+    }
+  }
+
+  int64_t prefix_sum(size_t index) const {
+    int64_t res = 0;
+    for (; index > 0; index -= index & (~index + 1)) {
+      res += fenwick[index];
+    }
+    return res;
+  }
+
+  void add(size_t index, int64_t value) {
+    for (; index < fenwick.size(); index += index & (~index + 1)) {
+      fenwick[index] += value;
+    }
+  }
+
+  static void print_region(std::ostream& out, const std::string& name, const Region& region) {
+    out << name << ": loads " << region.loads << ", stores " << region.stores << ", working set "
+        << region.words.size() * 4 << " bytes, stack high-water " << region.max_stack_depth << " bytes";
+    if (region.reuses) {
+      out << ", mean reuse distance " << region.reuse_distance_sum / region.reuses;
+    }
+    if (region.cache_hits + region.cache_misses) {
+      out << ", cache hit rate " << 100 * region.cache_hits / (region.cache_hits + region.cache_misses) << '%';
+    }
+    out << '\n';
+  }
+
+  std::unique_ptr<CacheModel> cache;
+  std::vector<uint32_t> call_stack{};
+  std::map<uint32_t, Region> regions{};
+  std::unordered_map<uint32_t, size_t> last_access{};
+  // 1-based, index 0 is unused. Compacted once most of its times are no word's last access.
+  static constexpr size_t MIN_COMPACTED_TIMES = 1 << 16;
+  std::vector<int64_t> fenwick{0};
+  std::vector<uint64_t> reuse_histogram{};
+  uint64_t cold_accesses{0};
+};
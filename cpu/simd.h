@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstdint>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+
+constexpr uint8_t VECTOR_REGISTERS = 16;
+constexpr uint32_t VECTOR_LANES = 4;
+constexpr uint32_t VECTOR_SIZE = VECTOR_LANES * 4;
+
+// 128-bit register holding four 32-bit lanes, lane 0 at the lowest guest address
+struct alignas(16) VectorRegister {
+  uint32_t lanes[VECTOR_LANES]{0, 0, 0, 0};
+
+  // SSE2 means a little-endian x86 host, so guest bytes map onto lanes directly
+  void load(const uint8_t* src) {
+#ifdef __SSE2__
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)));
+#else
+    for (uint32_t i = 0; i < VECTOR_LANES; ++i) {
+      lanes[i] = static_cast<uint32_t>(src[4 * i]) | (static_cast<uint32_t>(src[4 * i + 1]) << 8) |
+                 (static_cast<uint32_t>(src[4 * i + 2]) << 16) | (static_cast<uint32_t>(src[4 * i + 3]) << 24);
+    }
+#endif
+  }
+
+  void store(uint8_t* dst) const {
+#ifdef __SSE2__
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_load_si128(reinterpret_cast<const __m128i*>(lanes)));
+#else
+    for (uint32_t i = 0; i < VECTOR_LANES; ++i) {
+      dst[4 * i] = static_cast<uint8_t>(lanes[i]);
+      dst[4 * i + 1] = static_cast<uint8_t>(lanes[i] >> 8);
+      dst[4 * i + 2] = static_cast<uint8_t>(lanes[i] >> 16);
+      dst[4 * i + 3] = static_cast<uint8_t>(lanes[i] >> 24);
+    }
+#endif
+  }
+
+  void splat(uint32_t value) {
+    for (uint32_t& lane : lanes) {
+      lane = value;
+    }
+  }
+
+  void add(const VectorRegister& other) {
+#ifdef __SSE2__
+    store_native(_mm_add_epi32(native(), other.native()));
+#else
+    for (uint32_t i = 0; i < VECTOR_LANES; ++i) {
+      lanes[i] += other.lanes[i];
+    }
+#endif
+  }
+
+  void sub(const VectorRegister& other) {
+#ifdef __SSE2__
+    store_native(_mm_sub_epi32(native(), other.native()));
+#else
+    for (uint32_t i = 0; i < VECTOR_LANES; ++i) {
+      lanes[i] -= other.lanes[i];
+    }
+#endif
+  }
+
+  void mul(const VectorRegister& other) {
+#if defined(__SSE4_1__)
+    store_native(_mm_mullo_epi32(native(), other.native()));
+#elif defined(__SSE2__)
+    __m128i a = native(), b = other.native();
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+    store_native(_mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                                    _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0))));
+#else
+    for (uint32_t i = 0; i < VECTOR_LANES; ++i) {
+      lanes[i] *= other.lanes[i];
+    }
+#endif
+  }
+
+  void compare_equal(const VectorRegister& other) {
+#ifdef __SSE2__
+    store_native(_mm_cmpeq_epi32(native(), other.native()));
+#else
+    for (uint32_t i = 0; i < VECTOR_LANES; ++i) {
+      lanes[i] = lanes[i] == other.lanes[i] ? 0xffffffffu : 0;
+    }
+#endif
+  }
+
+  void compare_greater(const VectorRegister& other) {
+#ifdef __SSE2__
+    store_native(_mm_cmpgt_epi32(native(), other.native()));
+#else
+    for (uint32_t i = 0; i < VECTOR_LANES; ++i) {
+      lanes[i] = static_cast<int32_t>(lanes[i]) > static_cast<int32_t>(other.lanes[i]) ? 0xffffffffu : 0;
+    }
+#endif
+  }
+
+  uint32_t sum() const {
+#ifdef __SSE2__
+    __m128i v = native();
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(v));
+#else
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+  }
+
+ private:
+#ifdef __SSE2__
+  __m128i native() const {
+    return _mm_load_si128(reinterpret_cast<const __m128i*>(lanes));
+  }
+
+  void store_native(__m128i value) {
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), value);
+  }
+#endif
+};
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <array>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+#include "assembler.h"
+#include "parallel_assembler.h"
+
+// Assembles a source read piece by piece into a streamed image (see image.h). Memory is bounded by the
+// labels and by the references still waiting for a label, not by the size of the program: encoded bytes
+// are written out as they come, and an operand is patched in place while its bytes are still buffered,
+// or by a fixup record once they are written.
+
+constexpr size_t STREAM_CHUNK = 1 << 16;
+
+class StreamEncoder {
+
+ public:
+  explicit StreamEncoder(std::ostream& out)
+      : out(out) {
+    out.write("\xffSTM", 4);
+  }
+
+  StreamEncoder(const StreamEncoder&) = delete;
+  StreamEncoder& operator=(const StreamEncoder&) = delete;
+
+  void add(const Statement& statement) {
+    if (statement.kind == statement_kind::LABEL) {
+      declare(statement);
+      return;
+    }
+    if (statement.kind == statement_kind::GLOBAL) {
+      globals.insert(intern(statement.name), static_cast<uint32_t>(statement.line_number));
+      return;
+    }
+    std::vector<uint8_t>& buffer = buffers[static_cast<size_t>(statement.section)];
+    size_t base = written[static_cast<size_t>(statement.section)];
+    if (statement.kind != statement_kind::INSTRUCTION) {
+      std::vector<Fixup> words;
+      encode_data(statement, buffer, words);
+      for (auto& word : words) {
+        word.position += base;
+        refer(word);
+      }
+    } else {
+      size_t position = push_instruction(buffer, statement);
+      if (statement.operand.is_label()) {
+        refer({base + position, statement.operand.label, statement.line_number, statement.get_command().type,
+               section_kind::CODE});
+      }
+    }
+    if (buffer.size() >= STREAM_CHUNK) {
+      flush(statement.section, false);
+    }
+  }
+
+  // Data addresses are only known now, as they follow all of the read-only data
+  void finish() {
+    globals.for_each([this](std::string_view name, uint32_t line_number) {
+      if (!labels.find(name)) {
+        error("Label not declared: " + std::string(name), line_number);
+      }
+    });
+    const Fixup* missing = nullptr;
+    for (const auto& references : waiting) {
+      if (!references.empty() && (!missing || references.front().line_number < missing->line_number)) {
+        missing = &references.front();
+      }
+    }
+    if (missing) {
+      error("Label not declared: " + std::string(missing->label), missing->line_number);
+    }
+    for (auto section : {section_kind::RODATA, section_kind::DATA, section_kind::CODE}) {
+      flush(section, true);
+    }
+    uint32_t data_address = Image::align_up(static_cast<uint32_t>(written[1]), DATA_ALIGNMENT);
+    for (const auto& fixup : data_fixups) {
+      resolve(fixup, data_address + *labels.find(fixup.label));
+    }
+    flush_fixups();
+    write_record(stream_record::END, nullptr, 0);
+  }
+
+ private:
+  // Label names outlive the source piece they were read from
+  std::string_view intern(std::string_view name) {
+    return *names.emplace(name).first;
+  }
+
+  void declare(const Statement& statement) {
+    std::string_view name = intern(statement.name);
+    auto offset = static_cast<uint32_t>(written[static_cast<size_t>(statement.section)] +
+                                        buffers[static_cast<size_t>(statement.section)].size());
+    const uint32_t* label = labels.find(name);
+    if (label && (*label != offset || section_of(name) != statement.section)) {
+      error("Label redeclared: " + std::string(name), statement.line_number);
+    }
+    labels.insert(name, offset);
+    if (statement.section != section_kind::CODE) {
+      data_labels.insert(name, static_cast<uint32_t>(statement.section));
+    }
+    const uint32_t* index = waiting_labels.find(name);
+    if (!index) {
+      return;
+    }
+    std::vector<Fixup> references;
+    references.swap(waiting[*index]);
+    for (auto& reference : references) {
+      reference.label = name;
+      refer(reference);
+    }
+  }
+
+  // Resolves a reference now if its label is known, otherwise keeps it until the label is declared
+  void refer(Fixup fixup) {
+    const uint32_t* label = labels.find(fixup.label);
+    if (label && section_of(fixup.label) == section_kind::DATA) {
+      fixup.label = intern(fixup.label);
+      data_fixups.push_back(fixup);
+    } else if (label) {
+      resolve(fixup, *label);
+    } else {
+      std::string_view name = intern(fixup.label);
+      const uint32_t* index = waiting_labels.find(name);
+      if (!index) {
+        waiting_labels.insert(name, static_cast<uint32_t>(waiting.size()));
+        waiting.emplace_back();
+        index = waiting_labels.find(name);
+      }
+      fixup.label = name;
+      waiting[*index].push_back(fixup);
+    }
+  }
+
+  void resolve(const Fixup& fixup, uint32_t address) {
+    uint32_t encoded = encode_operand(fixup.position, fixup.type, address, fixup.line_number);
+    size_t size = operand_size(fixup.type);
+    size_t section = static_cast<size_t>(fixup.section);
+    if (fixup.position >= written[section]) {
+      for (size_t i = 0; i < size; ++i) {
+        buffers[section][fixup.position - written[section] + i] = static_cast<uint8_t>(encoded >> (8 * i));
+      }
+      return;
+    }
+    fixups.push_back(static_cast<uint8_t>(fixup.section));
+    fixups.push_back(static_cast<uint8_t>(size));
+    image_detail::put_uint32(fixups, static_cast<uint32_t>(fixup.position));
+    image_detail::put_uint32(fixups, encoded);
+    if (fixups.size() >= STREAM_CHUNK) {
+      flush_fixups();
+    }
+  }
+
+  // Keeps a partial alignment unit buffered, so that `.align` can still be applied to the buffer
+  void flush(section_kind kind, bool all) {
+    std::vector<uint8_t>& buffer = buffers[static_cast<size_t>(kind)];
+    size_t size = all ? buffer.size() : buffer.size() / DATA_ALIGNMENT * DATA_ALIGNMENT;
+    if (size == 0) {
+      return;
+    }
+    write_record(static_cast<stream_record>(kind), buffer.data(), size);
+    buffer.erase(buffer.begin(), buffer.begin() + static_cast<ptrdiff_t>(size));
+    written[static_cast<size_t>(kind)] += size;
+  }
+
+  void flush_fixups() {
+    if (!fixups.empty()) {
+      write_record(stream_record::FIXUPS, fixups.data(), fixups.size());
+      fixups.clear();
+    }
+  }
+
+  void write_record(stream_record kind, const uint8_t* payload, size_t size) {
+    std::vector<uint8_t> header{static_cast<uint8_t>(kind)};
+    image_detail::put_uint32(header, static_cast<uint32_t>(size));
+    out.write(reinterpret_cast<const char*>(header.data()), static_cast<std::streamsize>(header.size()));
+    out.write(reinterpret_cast<const char*>(payload), static_cast<std::streamsize>(size));
+  }
+
+  section_kind section_of(std::string_view name) const {
+    const uint32_t* section = data_labels.find(name);
+    return section ? static_cast<section_kind>(*section) : section_kind::CODE;
+  }
+
+  std::ostream& out;
+  // Bytes of each section not written yet, and how many were written before them
+  std::array<std::vector<uint8_t>, 3> buffers{};
+  std::array<size_t, 3> written{{0, 0, 0}};
+  std::unordered_set<std::string> names{};
+  LabelTable labels{};
+  // Section of every label outside the code section
+  LabelTable data_labels{};
+  LabelTable globals{};
+  // References to each label not declared yet, by index into `waiting`
+  LabelTable waiting_labels{};
+  std::vector<std::vector<Fixup>> waiting{};
+  std::vector<Fixup> data_fixups{};
+  // Encoded FIXUPS record not written yet
+  std::vector<uint8_t> fixups{};
+};
+
+// Reads whole lines up to about STREAM_CHUNK bytes at a time; statements never span lines
+inline void assemble_stream(std::istream& in, std::ostream& out) {
+  StreamEncoder encoder(out);
+  section_kind section = section_kind::CODE;
+  size_t lines = 0;
+  std::string chunk;
+  std::string line;
+  while (true) {
+    chunk.clear();
+    while (chunk.size() < STREAM_CHUNK && std::getline(in, line)) {
+      chunk += line;
+      chunk += '\n';
+    }
+    if (chunk.empty()) {
+      break;
+    }
+    for (const auto& statement : parse(chunk, section, lines)) {
+      encoder.add(statement);
+    }
+    auto summary = parallel_detail::summarize(chunk);
+    lines += summary.lines;
+    section = summary.switches_section ? summary.last_section : section;
+  }
+  encoder.finish();
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "image.h"
+
+// Symbol table written next to an image by `assembler -s` and `linker -s`.
+// Code symbols are program offsets and data symbols are addresses, as the CPU sees them.
+//
+//   "NSYM" count
+//   symbols sorted by section and offset: section, offset, name length (1 byte), name
+
+class SymbolError : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+struct Symbol {
+  section_kind section{section_kind::CODE};
+  uint32_t offset{0};
+  std::string name{};
+};
+
+class SymbolTable {
+
+ public:
+  SymbolTable() = default;
+
+  explicit SymbolTable(std::vector<Symbol> symbols)
+      : symbols(std::move(symbols)) {
+    std::sort(this->symbols.begin(), this->symbols.end(), [](const Symbol& a, const Symbol& b) {
+      return std::tie(a.section, a.offset, a.name) < std::tie(b.section, b.offset, b.name);
+    });
+  }
+
+  // Closest symbol at or before `offset` in the section, or nullptr
+  const Symbol* find(section_kind section, uint32_t offset) const {
+    auto it = std::upper_bound(symbols.begin(), symbols.end(), std::make_pair(section, offset),
+                               [](const std::pair<section_kind, uint32_t>& key, const Symbol& symbol) {
+                                 return key < std::make_pair(symbol.section, symbol.offset);
+                               });
+    if (it == symbols.begin() || (--it)->section != section) {
+      return nullptr;
+    }
+    return &*it;
+  }
+
+  // `@name` or `@name+distance`, empty if no symbol comes before `offset`
+  std::string describe(section_kind section, uint32_t offset) const {
+    const Symbol* symbol = find(section, offset);
+    if (!symbol) {
+      return "";
+    }
+    if (symbol->offset == offset) {
+      return symbol->name;
+    }
+    return symbol->name + "+" + std::to_string(offset - symbol->offset);
+  }
+
+  const std::vector<Symbol>& get_symbols() const {
+    return symbols;
+  }
+
+ private:
+  std::vector<Symbol> symbols{};
+};
+
+
+inline std::vector<uint8_t> write_symbols(const SymbolTable& table) {
+  std::vector<uint8_t> out{'N', 'S', 'Y', 'M'};
+  image_detail::put_uint32(out, static_cast<uint32_t>(table.get_symbols().size()));
+  for (const auto& symbol : table.get_symbols()) {
+    if (symbol.name.size() > 0xff) {
+      throw SymbolError("Symbol name too long: " + symbol.name);
+    }
+    out.push_back(static_cast<uint8_t>(symbol.section));
+    image_detail::put_uint32(out, symbol.offset);
+    out.push_back(static_cast<uint8_t>(symbol.name.size()));
+    out.insert(out.end(), symbol.name.begin(), symbol.name.end());
+  }
+  return out;
+}
+
+inline SymbolTable read_symbols(const std::vector<uint8_t>& data) {
+  if (data.size() < 8 || data[0] != 'N' || data[1] != 'S' || data[2] != 'Y' || data[3] != 'M') {
+    throw SymbolError("Not a symbol table");
+  }
+  uint32_t count = image_detail::get_uint32(data, 4);
+  if (count > (data.size() - 8) / 6) {
+    throw SymbolError("Truncated symbol table");
+  }
+  std::vector<Symbol> symbols(count);
+  size_t pos = 8;
+  for (auto& symbol : symbols) {
+    if (pos + 6 > data.size() || pos + 6 + data[pos + 5] > data.size()) {
+      throw SymbolError("Truncated symbol table");
+    }
+    if (data[pos] > static_cast<uint8_t>(section_kind::DATA)) {
+      throw SymbolError("Invalid section");
+    }
+    symbol.section = static_cast<section_kind>(data[pos]);
+    symbol.offset = image_detail::get_uint32(data, pos + 1);
+    symbol.name.assign(data.begin() + static_cast<ptrdiff_t>(pos + 6),
+                       data.begin() + static_cast<ptrdiff_t>(pos + 6 + data[pos + 5]));
+    pos += 6 + data[pos + 5];
+  }
+  return SymbolTable(std::move(symbols));
+}
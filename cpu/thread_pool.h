@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running batches of independent tasks; the calling thread takes part.
+// The workers are started by the first batch, so a pool that is never used costs nothing.
+class ThreadPool {
+
+ public:
+  explicit ThreadPool(size_t thread_count) : threads(std::max<size_t>(thread_count, 1)) {}
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+  }
+
+  size_t size() const {
+    return threads;
+  }
+
+  // Calls task(0) ... task(count - 1) and waits for all of them. If tasks throw, the exception of the
+  // lowest index is rethrown, which is the one a sequential loop would have stopped at.
+  void run(size_t count, const std::function<void(size_t)>& task) {
+    std::vector<std::exception_ptr> errors(count);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (size_t i = workers.size() + 1; i < threads; ++i) {
+        workers.emplace_back([this]() {
+          work();
+        });
+      }
+      current = &task;
+      current_errors = &errors;
+      task_count = count;
+      next_task = 0;
+      ++batch;
+    }
+    wake.notify_all();
+    run_tasks(task, errors, count);
+    {
+      // Once the caller has run out of tasks, the batch is over when no worker is still in it
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock, [this]() {
+        return active == 0;
+      });
+      current = nullptr;
+    }
+    for (auto& error : errors) {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+  }
+
+ private:
+  // A worker takes its batch under the lock and is counted until it leaves, so run() cannot return
+  // and start the next batch while the worker still uses this one
+  void work() {
+    size_t seen_batch = 0;
+    while (true) {
+      const std::function<void(size_t)>* task = nullptr;
+      std::vector<std::exception_ptr>* errors = nullptr;
+      size_t count = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this, seen_batch]() {
+          return stopping || batch != seen_batch;
+        });
+        if (stopping) {
+          return;
+        }
+        seen_batch = batch;
+        if (!current) {
+          continue;
+        }
+        task = current;
+        errors = current_errors;
+        count = task_count;
+        ++active;
+      }
+      run_tasks(*task, *errors, count);
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--active == 0) {
+        done.notify_all();
+      }
+    }
+  }
+
+  void run_tasks(const std::function<void(size_t)>& task, std::vector<std::exception_ptr>& errors, size_t count) {
+    while (true) {
+      size_t index = next_task.fetch_add(1);
+      if (index >= count) {
+        return;
+      }
+      try {
+        task(index);
+      } catch (...) {
+        errors[index] = std::current_exception();
+      }
+    }
+  }
+
+  size_t threads;
+  std::vector<std::thread> workers{};
+  std::mutex mutex{};
+  std::condition_variable wake{};
+  std::condition_variable done{};
+  const std::function<void(size_t)>* current{nullptr};
+  std::vector<std::exception_ptr>* current_errors{nullptr};
+  size_t task_count{0};
+  std::atomic<size_t> next_task{0};
+  size_t active{0};
+  size_t batch{0};
+  bool stopping{false};
+};
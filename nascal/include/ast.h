@@ -5,26 +5,69 @@
 #include <map>
 #include <memory>
 #include <cassert>
-
+#include <algorithm>
+#include "emitter.h"
+#include "regalloc.h"
+#include "simplify.h"
 
 class compile_error : public std::runtime_error {
   using std::runtime_error::runtime_error;
 };
 
 
+struct ASTNode;
+struct Expression;
+
 struct CompilationContext {
-  std::vector<std::string> code;
+  Code code;
   std::map<std::string, size_t> offsets;
+  std::map<std::string, uint8_t> registers;
+  std::vector<uint8_t> saved_registers;
   size_t extra_offset;
   size_t local_count;
+  // Temporaries taken, and how many of them a call being compiled has already saved
+  size_t temp_count;
+  size_t saved_temp_count;
   std::string loop_start_label, loop_end_label;
+  // Labels numbered by the code that takes them, for code whose labels cannot be told apart by position
+  size_t label_count;
+  // The function being compiled, where its body starts after the prologue, and the calls it ends with
+  std::string function_name;
+  std::vector<std::string> params;
+  std::string start_label;
+  std::set<const Expression*> tail_calls;
+  // Functions taking their first arguments in registers
+  std::set<std::pair<std::string, size_t>> register_functions;
+
+  size_t passed_in_registers(const std::string& func, size_t arg_count) const {
+    return register_functions.count({func, arg_count}) ? std::min(arg_count, ARG_REG_COUNT) : 0;
+  }
+
+  // Returns 0 when all temporaries are taken
+  uint8_t acquire_temp() {
+    if (FIRST_TEMP_REG + temp_count > LAST_TEMP_REG) {
+      return 0;
+    }
+    return static_cast<uint8_t>(FIRST_TEMP_REG + temp_count++);
+  }
+
+  void release_temp() {
+    --temp_count;
+  }
 };
 
 using offsets_t = std::map<std::string, size_t>;
 
+using node_ptr_t = std::unique_ptr<ASTNode>;
+using expr_ptr_t = std::unique_ptr<Expression>;
+
 struct ASTNode {
   virtual void assemble(CompilationContext& c) const = 0;
 
+  virtual void collect_usage(VariableUsage& usage) const = 0;
+
+  virtual void simplify() = 0;
+
   virtual ~ASTNode() {
   };
 };
@@ -37,20 +80,116 @@ struct Expression {
     throw compile_error("Taking address of rvalue");
   }
 
+  // Jumps to `label` if the expression is true with `when`, or false without it, using `reg` to compute it
+  virtual void assemble_branch(CompilationContext& c, uint8_t reg, bool when, const std::string& label) const {
+    assemble(c, reg);
+    c.code.emit("and", reg, reg);
+    c.code.emit_jump(when ? "juz" : "jiz", label);
+  }
+
+  // Register holding the value of a variable, 0 if it is not one
+  virtual uint8_t get_register(const CompilationContext& c) const {
+    return 0;
+  }
+
+  virtual void collect_usage(VariableUsage& usage) const {
+  }
+
+  virtual void collect_address_usage(VariableUsage& usage) const {
+    collect_usage(usage);
+  }
+
+  // Replaces the expression, owned by `self`, with a cheaper one computing the same value with the same effects
+  virtual void simplify(expr_ptr_t& self) {
+  }
+
+  virtual bool get_constant(int32_t& value) const {
+    return false;
+  }
+
+  // Pure expressions have no effects and cannot fail, so they may be dropped or computed once for two uses
+  virtual bool is_pure() const {
+    return false;
+  }
+
+  virtual bool is_non_negative() const {
+    return false;
+  }
+
+  // Whether the value is always 0 or 1
+  virtual bool is_truth_value() const {
+    return false;
+  }
+
+  virtual bool same_as(const Expression& other) const {
+    return false;
+  }
+
   virtual ~Expression() {
   };
 };
 
-using node_ptr_t = std::unique_ptr<ASTNode>;
-using expr_ptr_t = std::unique_ptr<Expression>;
 
+void collect_nodes_usage(VariableUsage& usage, const std::vector<node_ptr_t>& nodes) {
+  for (const auto& o : nodes) {
+    o->collect_usage(usage);
+  }
+}
 
-uint8_t another_reg(uint8_t reg, uint8_t offset = 1) {
-  return (static_cast<size_t>(reg) + offset - 1) % 250u + 1;
+void simplify_nodes(std::vector<node_ptr_t>& nodes) {
+  for (auto& o : nodes) {
+    o->simplify();
+  }
 }
 
-std::string reg_name(uint8_t reg) {
-  return "R" + std::to_string(reg);
+// Frees the frame and restores the saved registers, leaving the return address on top of the stack
+void release_frame(CompilationContext& c) {
+  if (c.local_count + c.extra_offset) {
+    c.code.emit_value("set", 0, (c.local_count + c.extra_offset) * 4);
+    c.code.emit("add", REG_STACK, 0);
+  }
+  for (auto it = c.saved_registers.rbegin(); it != c.saved_registers.rend(); ++it) {
+    c.code.emit("pop", *it);
+  }
+}
+
+struct IntExpression : public Expression {
+  int32_t value{0};
+
+  void assemble(CompilationContext& c, uint8_t out) const override {
+    if (!out) {
+      return;
+    }
+    c.code.emit_value("set", out, value);
+  }
+
+  bool get_constant(int32_t& v) const override {
+    v = value;
+    return true;
+  }
+
+  bool is_pure() const override {
+    return true;
+  }
+
+  bool is_non_negative() const override {
+    return value >= 0;
+  }
+
+  bool is_truth_value() const override {
+    return value == 0 || value == 1;
+  }
+
+  bool same_as(const Expression& other) const override {
+    int32_t v = 0;
+    return other.get_constant(v) && v == value;
+  }
+};
+
+expr_ptr_t make_int(int32_t value) {
+  auto num = std::make_unique<IntExpression>();
+  num->value = value;
+  return num;
 }
 
 struct NameExpression : public Expression {
@@ -60,28 +199,141 @@ struct NameExpression : public Expression {
     if (!out) {
       return;
     }
+    if (uint8_t reg = get_register(c)) {
+      if (reg != out) {
+        c.code.emit("mov", out, reg);
+      }
+      return;
+    }
     size_t offset = c.offsets.at(name) + c.extra_offset;
     if (offset) {
-      c.code.push_back("set " + reg_name(out) + ' ' + std::to_string(offset * 4));
-      c.code.push_back("add " + reg_name(out) + " RS");
-      c.code.push_back("load32 " + reg_name(out) + ' ' + reg_name(out));
+      c.code.emit_value("set", out, offset * 4);
+      c.code.emit("add", out, REG_STACK);
+      c.code.emit("load32", out, out);
     } else {
-      c.code.push_back("load32 " + reg_name(out) + " RS");
+      c.code.emit("load32", out, REG_STACK);
     }
   }
 
   void get_address(CompilationContext &c, uint8_t out) const override {
+    if (get_register(c)) {
+      throw compile_error("Taking address of register variable " + name);
+    }
     if (!out) {
       return;
     }
     size_t offset = c.offsets.at(name) + c.extra_offset;
     if (offset) {
-      c.code.push_back("set " + reg_name(out) + ' ' + std::to_string(offset * 4));
-      c.code.push_back("add " + reg_name(out) + " RS");
+      c.code.emit_value("set", out, offset * 4);
+      c.code.emit("add", out, REG_STACK);
     } else {
-      c.code.push_back("mov " + reg_name(out) + " RS");
+      c.code.emit("mov", out, REG_STACK);
     }
   }
+
+  uint8_t get_register(const CompilationContext& c) const override {
+    auto it = c.registers.find(name);
+    return it != c.registers.end() ? it->second : 0;
+  }
+
+  void collect_usage(VariableUsage& usage) const override {
+    usage.mention(name);
+  }
+
+  void collect_address_usage(VariableUsage& usage) const override {
+    usage.address_taken.insert(name);
+    usage.mention(name);
+  }
+
+  bool is_pure() const override {
+    return true;
+  }
+
+  bool same_as(const Expression& other) const override {
+    auto name_expression = dynamic_cast<const NameExpression*>(&other);
+    return name_expression && name_expression->name == name;
+  }
+};
+
+// AND (op '&') and OR (op '|'), which compute their right operand only when the left one does not decide
+// the result. The result is 0 or 1.
+struct LogicalExpression : public Expression {
+  expr_ptr_t left{nullptr};
+  expr_ptr_t right{nullptr};
+  char op{0};
+
+  // The operands are tested in SPILL_REG, so `out` is written only after every variable has been read
+  void assemble(CompilationContext& c, uint8_t out) const override {
+    if (!out) {
+      std::string label_end = "@skip" + std::to_string(++c.label_count);
+      left->assemble_branch(c, SPILL_REG, op == '|', label_end);
+      right->assemble(c, 0);
+      c.code.label(label_end);
+      return;
+    }
+    std::string label_false = "@false" + std::to_string(++c.label_count);
+    std::string label_end = "@done" + std::to_string(c.label_count);
+    assemble_branch(c, SPILL_REG, false, label_false);
+    c.code.emit_value("set", out, 1);
+    c.code.emit_jump("jmp", label_end);
+    c.code.label(label_false);
+    c.code.emit("xor", out, out);
+    c.code.label(label_end);
+  }
+
+  // Either operand jumps to `label` when it decides the result on its own, as AND does with a false one
+  void assemble_branch(CompilationContext& c, uint8_t reg, bool when, const std::string& label) const override {
+    if (when == (op == '|')) {
+      left->assemble_branch(c, reg, when, label);
+      right->assemble_branch(c, reg, when, label);
+      return;
+    }
+    std::string label_skip = "@skip" + std::to_string(++c.label_count);
+    left->assemble_branch(c, reg, !when, label_skip);
+    right->assemble_branch(c, reg, when, label);
+    c.code.label(label_skip);
+  }
+
+  void collect_usage(VariableUsage& usage) const override {
+    left->collect_usage(usage);
+    right->collect_usage(usage);
+  }
+
+  // A constant operand either decides the result or leaves it to the other operand
+  void simplify(expr_ptr_t& self) override {
+    left->simplify(left);
+    right->simplify(right);
+    int32_t a = 0, b = 0;
+    bool decides = op == '|';
+    if (left->get_constant(a) && (a != 0) == decides) {
+      self = make_int(decides);
+    } else if (left->get_constant(a) && right->is_truth_value()) {
+      expr_ptr_t x = std::move(right);
+      self = std::move(x);
+    } else if (right->get_constant(b) && (b != 0) == decides && left->is_pure()) {
+      self = make_int(decides);
+    } else if (right->get_constant(b) && (b != 0) != decides && left->is_truth_value()) {
+      expr_ptr_t x = std::move(left);
+      self = std::move(x);
+    }
+  }
+
+  bool is_pure() const override {
+    return left->is_pure() && right->is_pure();
+  }
+
+  bool is_non_negative() const override {
+    return true;
+  }
+
+  bool is_truth_value() const override {
+    return true;
+  }
+
+  bool same_as(const Expression& other) const override {
+    auto logical = dynamic_cast<const LogicalExpression*>(&other);
+    return logical && logical->op == op && left->same_as(*logical->left) && right->same_as(*logical->right);
+  }
 };
 
 struct BinExpression : public Expression {
@@ -89,68 +341,297 @@ struct BinExpression : public Expression {
   expr_ptr_t right{nullptr};
   char op{0};
 
+  // The right operand is computed first, so `out` is written only after every variable has been read
   void assemble(CompilationContext& c, uint8_t out) const override {
     if (!out) {
       right->assemble(c, 0);
       left->assemble(c, 0);
       return;
     }
-    right->assemble(c, out);
-    c.code.push_back("push " + reg_name(out));
-    ++c.extra_offset;
-    left->assemble(c, out);
-    c.code.push_back("pop " + reg_name(another_reg(out)));
-    --c.extra_offset;
+    bool acquired = false;
+    uint8_t a = out;
+    uint8_t b = assemble_operands(c, out, acquired);
     std::string label_base = "@l" + std::to_string(c.code.size());
     switch (op) {
       case '=':
-        c.code.push_back("xor " + reg_name(another_reg(out)) + ' ' + reg_name(out));
-        c.code.push_back("set " + reg_name(out) + " 1");
-        c.code.push_back("jiz " + label_base);
-        c.code.push_back("xor " + reg_name(out) + ' ' + reg_name(out));
-        c.code.push_back(label_base);
+        c.code.emit("xor", a, b);
+        c.code.emit_value("set", a, 1);
+        c.code.emit_jump("jiz", label_base);
+        c.code.emit("xor", a, a);
+        c.code.label(label_base);
         break;
       case '<':
-        c.code.push_back("sub " + reg_name(out) + ' ' + reg_name(another_reg(out)));
-        c.code.push_back("set " + reg_name(out) + " 1");
-        c.code.push_back("jis " + label_base);
-        c.code.push_back("xor " + reg_name(out) + ' ' + reg_name(out));
-        c.code.push_back(label_base);
+        c.code.emit("sub", a, b);
+        c.code.emit_value("set", a, 1);
+        c.code.emit_jump("jis", label_base);
+        c.code.emit("xor", a, a);
+        c.code.label(label_base);
         break;
       case '>':
-        c.code.push_back("sub " + reg_name(another_reg(out)) + ' ' + reg_name(out));
-        c.code.push_back("set " + reg_name(out) + " 1");
-        c.code.push_back("jis " + label_base);
-        c.code.push_back("xor " + reg_name(out) + ' ' + reg_name(out));
-        c.code.push_back(label_base);
+        c.code.emit("sub", b, a);
+        c.code.emit_value("set", a, 1);
+        c.code.emit_jump("jis", label_base);
+        c.code.emit("xor", a, a);
+        c.code.label(label_base);
         break;
       case '+':
-        c.code.push_back("add " + reg_name(out) + " " + reg_name(another_reg(out)));
+        c.code.emit("add", a, b);
         break;
       case '-':
-        c.code.push_back("sub " + reg_name(out) + " " + reg_name(another_reg(out)));
+        c.code.emit("sub", a, b);
         break;
       case '|':
-        c.code.push_back("or " + reg_name(out) + " " + reg_name(another_reg(out)));
+        c.code.emit("or", a, b);
         break;
       case '^':
-        c.code.push_back("xor " + reg_name(out) + " " + reg_name(another_reg(out)));
+        c.code.emit("xor", a, b);
         break;
       case '*':
-        c.code.push_back("smul " + reg_name(out) + " " + reg_name(another_reg(out)));
+        c.code.emit("smul", a, b);
         break;
       case '/':
-        c.code.push_back("sdiv " + reg_name(out) + " " + reg_name(another_reg(out)));
+        c.code.emit("sdiv", a, b);
         break;
       case '%':
-        c.code.push_back("smod " + reg_name(out) + " " + reg_name(another_reg(out)));
+        c.code.emit("smod", a, b);
         break;
       case '&':
-        c.code.push_back("and " + reg_name(out) + " " + reg_name(another_reg(out)));
+        c.code.emit("and", a, b);
+        break;
+      case SHIFT_OP:
+        c.code.emit("shift", a, b);
         break;
       default:
         assert(false);
     }
+    if (acquired && b) {
+      c.release_temp();
+    }
+  }
+
+  // Comparisons branch on the flags of the subtraction or the exclusive or computing them
+  void assemble_branch(CompilationContext& c, uint8_t reg, bool when, const std::string& label) const override {
+    if (op != '=' && op != '<' && op != '>') {
+      Expression::assemble_branch(c, reg, when, label);
+      return;
+    }
+    bool acquired = false;
+    uint8_t other = assemble_operands(c, reg, acquired);
+    if (op == '=') {
+      c.code.emit("xor", reg, other);
+      c.code.emit_jump(when ? "jiz" : "juz", label);
+    } else {
+      c.code.emit("sub", op == '<' ? reg : other, op == '<' ? other : reg);
+      c.code.emit_jump(when ? "jis" : "jus", label);
+    }
+    if (acquired && other) {
+      c.release_temp();
+    }
+  }
+
+  // Computes the left operand into `out` and returns the register holding the right one. A variable is used
+  // from its register, unless `out` is that register or the operation overwrites it; otherwise the right
+  // operand is computed into a temporary, which is `acquired`, or into R0 when there is none.
+  uint8_t assemble_operands(CompilationContext& c, uint8_t out, bool& acquired) const {
+    uint8_t other = right->get_register(c);
+    acquired = !other || other == out || op == '>';
+    if (acquired) {
+      other = c.acquire_temp();
+    }
+    if (!acquired) {
+      left->assemble(c, out);
+    } else if (other) {
+      right->assemble(c, other);
+      left->assemble(c, out);
+    } else {
+      right->assemble(c, SPILL_REG);
+      c.code.emit("push", SPILL_REG);
+      ++c.extra_offset;
+      left->assemble(c, out);
+      c.code.emit("pop", 0);
+      --c.extra_offset;
+    }
+    return other;
+  }
+
+  // A variable on the right may be read from its register only after the left operand is computed
+  void collect_usage(VariableUsage& usage) const override {
+    right->collect_usage(usage);
+    left->collect_usage(usage);
+    if (auto name = dynamic_cast<const NameExpression*>(right.get())) {
+      usage.extend(name->name);
+    }
+  }
+
+  void simplify(expr_ptr_t& self) override {
+    left->simplify(left);
+    right->simplify(right);
+    reduce(self);
+  }
+
+  bool is_pure() const override {
+    int32_t divisor = 0;
+    if ((op == '/' || op == '%') && !(right->get_constant(divisor) && divisor != 0 && divisor != -1)) {
+      return false;
+    }
+    return left->is_pure() && right->is_pure();
+  }
+
+  bool is_non_negative() const override {
+    int32_t count = 0;
+    switch (op) {
+      case '=':
+      case '<':
+      case '>':
+        return true;
+      case '&':
+        return left->is_non_negative() || right->is_non_negative();
+      case '|':
+      case '^':
+      case '/':
+        return left->is_non_negative() && right->is_non_negative();
+      case '%':
+        return left->is_non_negative();
+      case SHIFT_OP:
+        return right->get_constant(count) && count < 0;
+      default:
+        return false;
+    }
+  }
+
+  bool is_truth_value() const override {
+    return op == '=' || op == '<' || op == '>';
+  }
+
+  bool same_as(const Expression& other) const override {
+    auto bin = dynamic_cast<const BinExpression*>(&other);
+    return bin && bin->op == op && left->same_as(*bin->left) && right->same_as(*bin->right);
+  }
+
+ private:
+  // Rules for this node alone, its operands are simplified already. Replacing `self` destroys this node.
+  void reduce(expr_ptr_t& self) {
+    int32_t a = 0, b = 0, result = 0;
+    bool left_constant = left->get_constant(a);
+    bool right_constant = right->get_constant(b);
+    if (left_constant && right_constant && fold_binary(op, a, b, result)) {
+      self = make_int(result);
+      return;
+    }
+    // A constant has no effects, so it can be computed after the other operand
+    if (left_constant && !right_constant && is_commutative(op)) {
+      std::swap(left, right);
+      right_constant = true;
+      b = a;
+    }
+    if (right_constant) {
+      reduce_constant(self, b);
+      return;
+    }
+    if (left->is_pure() && left->same_as(*right)) {
+      switch (op) {
+        case '-':
+        case '^':
+        case '<':
+        case '>':
+          self = make_int(0);
+          return;
+        case '=':
+          self = make_int(1);
+          return;
+        case '&':
+        case '|':
+          self = std::move(left);
+          return;
+        default:
+          break;
+      }
+    }
+  }
+
+  void reduce_constant(expr_ptr_t& self, int32_t b) {
+    if (op == '-') {
+      op = '+';
+      fold_unary('-', b, b);
+      right = make_int(b);
+    }
+    int k = power_of_two(b);
+    switch (op) {
+      case '+':
+      case '^':
+      case SHIFT_OP:
+        if (b == 0) {
+          self = std::move(left);
+          return;
+        }
+        break;
+      case '*':
+        if (b == 1) {
+          self = std::move(left);
+          return;
+        }
+        if (b == 0 && left->is_pure()) {
+          self = make_int(0);
+          return;
+        }
+        if (k > 0) {
+          op = SHIFT_OP;
+          right = make_int(k);
+        }
+        break;
+      // Division truncates towards zero, which a logical shift only does for non-negative numbers
+      case '/':
+        if (b == 1) {
+          self = std::move(left);
+          return;
+        }
+        if (k > 0 && left->is_non_negative()) {
+          op = SHIFT_OP;
+          right = make_int(-k);
+        }
+        break;
+      case '%':
+        if (b == 1 && left->is_pure()) {
+          self = make_int(0);
+          return;
+        }
+        if (k > 0 && left->is_non_negative()) {
+          op = '&';
+          right = make_int(b - 1);
+        }
+        break;
+      case '&':
+      case '|':
+        if (b == (op == '&' ? -1 : 0)) {
+          self = std::move(left);
+          return;
+        }
+        if (b == (op == '&' ? 0 : -1) && left->is_pure()) {
+          self = make_int(b);
+          return;
+        }
+        break;
+      default:
+        return;
+    }
+    right->get_constant(b);
+    // (x + 1) + 2 is x + 3
+    auto inner = dynamic_cast<BinExpression*>(left.get());
+    int32_t c = 0, result = 0;
+    if (!inner || inner->op != op || !inner->right->get_constant(c) || op == '%' || op == '/') {
+      return;
+    }
+    if (op == SHIFT_OP && ((c < 0) != (b < 0) || c + b <= -32 || c + b >= 32)) {
+      return;
+    }
+    if (op == SHIFT_OP) {
+      result = c + b;
+    } else {
+      fold_binary(op, c, b, result);
+    }
+    inner->right = make_int(result);
+    self = std::move(left);
+    inner->reduce(self);
   }
 };
 
@@ -170,26 +651,34 @@ struct UnaryExpression : public Expression {
     std::string label_base = "@l" + std::to_string(c.code.size());
     switch (op) {
       case '-':
-        c.code.push_back("neg " + reg_name(out));
+        c.code.emit("neg", out);
         break;
       case '~':
-        c.code.push_back("not " + reg_name(out));
+        c.code.emit("not", out);
         break;
       case '!':
-        c.code.push_back("and " + reg_name(out) + ' ' + reg_name(out));
-        c.code.push_back("set " + reg_name(out) + " 1");
-        c.code.push_back("jiz " + label_base);
-        c.code.push_back("xor " + reg_name(out) + ' ' + reg_name(out));
-        c.code.push_back(label_base);
+        c.code.emit("and", out, out);
+        c.code.emit_value("set", out, 1);
+        c.code.emit_jump("jiz", label_base);
+        c.code.emit("xor", out, out);
+        c.code.label(label_base);
         break;
       case '$':
-        c.code.push_back("load32 " + reg_name(out) + ' ' + reg_name(out));
+        c.code.emit("load32", out, out);
         break;
       default:
         assert(false);
     }
   }
 
+  void assemble_branch(CompilationContext& c, uint8_t reg, bool when, const std::string& label) const override {
+    if (op == '!') {
+      operand->assemble_branch(c, reg, !when, label);
+      return;
+    }
+    Expression::assemble_branch(c, reg, when, label);
+  }
+
   void get_address(CompilationContext &c, uint8_t out) const override {
     if (op == '$') {
       operand->assemble(c, out);
@@ -197,70 +686,474 @@ struct UnaryExpression : public Expression {
     }
     Expression::get_address(c, out);
   }
-};
 
-struct IntExpression : public Expression {
-  int32_t value{0};
+  void collect_usage(VariableUsage& usage) const override {
+    if (op == '@') {
+      operand->collect_address_usage(usage);
+    } else {
+      operand->collect_usage(usage);
+    }
+  }
 
-  void assemble(CompilationContext& c, uint8_t out) const override {
-    if (!out) {
+  void simplify(expr_ptr_t& self) override {
+    operand->simplify(operand);
+    int32_t a = 0, result = 0;
+    if (operand->get_constant(a) && fold_unary(op, a, result)) {
+      self = make_int(result);
       return;
     }
-    c.code.push_back("set " + reg_name(out) + ' ' + std::to_string(value));
+    // -(-x), ~(~x) and $(@x) are x
+    auto inner = dynamic_cast<UnaryExpression*>(operand.get());
+    if (inner && (inner->op == (op == '$' ? '@' : op)) && (op == '-' || op == '~' || op == '$')) {
+      expr_ptr_t x = std::move(inner->operand);
+      self = std::move(x);
+    }
+  }
+
+  bool is_pure() const override {
+    return op != '$' && operand->is_pure();
+  }
+
+  bool is_non_negative() const override {
+    return op == '!';
+  }
+
+  bool is_truth_value() const override {
+    return op == '!';
+  }
+
+  bool same_as(const Expression& other) const override {
+    auto unary = dynamic_cast<const UnaryExpression*>(&other);
+    return unary && unary->op == op && operand->same_as(*unary->operand);
   }
 };
 
+const std::map<std::pair<std::string, size_t>, std::string> builtin_functions = {{{"memcpy", 3}, "memcpy"},
+                                                                                   {{"memset", 3}, "memset"},
+                                                                                   {{"memcmp", 3}, "memcmp"}};
+
 struct CallExpression : public Expression {
   std::string func;
   std::vector<expr_ptr_t> args;
 
   void assemble(CompilationContext& c, uint8_t out) const override {
-    for (const auto& arg : args) {
-      arg->assemble(c, another_reg(out));
-      c.code.push_back("push " + reg_name(another_reg(out)));
+    auto builtin = builtin_functions.find({func, args.size()});
+    if (builtin != builtin_functions.end()) {
+      assemble_builtin(c, out, builtin->second);
+      return;
+    }
+    // Temporaries taken since the enclosing call, if any, hold operands still to be used
+    std::vector<uint8_t> kept;
+    for (size_t i = c.saved_temp_count; i < c.temp_count; ++i) {
+      if (FIRST_TEMP_REG + i != out) {
+        kept.push_back(static_cast<uint8_t>(FIRST_TEMP_REG + i));
+      }
+    }
+    for (auto reg : kept) {
+      c.code.emit("push", reg);
+      ++c.extra_offset;
+    }
+    size_t saved_temp_count = c.saved_temp_count;
+    c.saved_temp_count = c.temp_count;
+    size_t temp_count = c.temp_count;
+    size_t passed = c.passed_in_registers(func, args.size());
+    size_t pushed = 0;
+    // Arguments passed in registers wait in a temporary, or on the stack, at the given depth, without one
+    std::vector<std::pair<uint8_t, size_t>> held;
+    for (size_t i = 0; i < args.size(); ++i) {
+      uint8_t reg = c.acquire_temp();
+      args[i]->assemble(c, reg ? reg : SPILL_REG);
+      if (i < passed && reg) {
+        held.emplace_back(reg, 0);
+        continue;
+      }
+      c.code.emit("push", reg ? reg : SPILL_REG);
       ++c.extra_offset;
+      ++pushed;
+      if (i < passed) {
+        held.emplace_back(0, c.extra_offset);
+      } else if (reg) {
+        c.release_temp();
+      }
     }
-    c.code.push_back("call @func_" + func + '_' + std::to_string(args.size()));
+    c.saved_temp_count = saved_temp_count;
+    for (size_t i = 0; i < held.size(); ++i) {
+      auto arg_reg = static_cast<uint8_t>(FIRST_ARG_REG + i);
+      if (held[i].first) {
+        c.code.emit("mov", arg_reg, held[i].first);
+      } else {
+        c.code.emit_value("set", arg_reg, (c.extra_offset - held[i].second) * 4);
+        c.code.emit("add", arg_reg, REG_STACK);
+        c.code.emit("load32", arg_reg, arg_reg);
+      }
+    }
+    c.temp_count = temp_count;
+    c.code.emit_jump("call", label());
     if (out) {
-      c.code.push_back("mov " + reg_name(out) + " R0");
+      c.code.emit("mov", out, 0);
+    }
+    if (pushed) {
+      c.code.emit_value("set", 0, pushed * 4);
+      c.code.emit("add", REG_STACK, 0);
+      c.extra_offset -= pushed;
+    }
+    for (auto it = kept.rbegin(); it != kept.rend(); ++it) {
+      c.code.emit("pop", *it);
+      --c.extra_offset;
+    }
+  }
+
+  // Leaves the function by jumping to the callee with the arguments in place of its own parameters, so the
+  // callee returns to the caller of the function. The callee must take no more arguments on the stack than
+  // the function does: the caller removes as many as it pushed. Returns false, having emitted nothing, if
+  // that cannot be done.
+  bool assemble_tail_call(CompilationContext& c) const {
+    size_t passed = c.passed_in_registers(func, args.size());
+    size_t slots = c.params.size() - c.passed_in_registers(c.function_name, c.params.size());
+    if (builtin_functions.count({func, args.size()}) || (!is_recursive(c) && args.size() - passed > slots)) {
+      return false;
+    }
+    size_t temp_count = c.temp_count;
+    std::vector<uint8_t> regs;
+    for (size_t i = 0; i < args.size(); ++i) {
+      regs.push_back(c.acquire_temp());
+    }
+    if (std::find(regs.begin(), regs.end(), 0) != regs.end()) {
+      c.temp_count = temp_count;
+      return false;
+    }
+    for (size_t i = 0; i < args.size(); ++i) {
+      args[i]->assemble(c, regs[i]);
+    }
+    if (is_recursive(c)) {
+      // The frame is kept, only the parameters change. A parameter passed in a register and never read has
+      // no place at all.
+      for (size_t i = 0; i < args.size(); ++i) {
+        auto reg = c.registers.find(c.params[i]);
+        if (reg != c.registers.end()) {
+          c.code.emit("mov", reg->second, regs[i]);
+        } else if (c.offsets.count(c.params[i])) {
+          c.code.emit_value("set", 0, (c.offsets.at(c.params[i]) + c.extra_offset) * 4);
+          c.code.emit("add", 0, REG_STACK);
+          c.code.emit("store32", 0, regs[i]);
+        }
+      }
+      if (c.extra_offset) {
+        c.code.emit_value("set", 0, c.extra_offset * 4);
+        c.code.emit("add", REG_STACK, 0);
+      }
+      c.code.emit_jump("jmp", c.start_label);
+    } else {
+      // The parameters of the callee are the slots nearest to the return address
+      release_frame(c);
+      for (size_t i = passed; i < args.size(); ++i) {
+        c.code.emit_value("set", 0, (args.size() - i) * 4);
+        c.code.emit("add", 0, REG_STACK);
+        c.code.emit("store32", 0, regs[i]);
+      }
+      for (size_t i = 0; i < passed; ++i) {
+        c.code.emit("mov", static_cast<uint8_t>(FIRST_ARG_REG + i), regs[i]);
+      }
+      c.code.emit_jump("jmp", label());
+    }
+    c.temp_count = temp_count;
+    return true;
+  }
+
+  bool is_recursive(const CompilationContext& c) const {
+    return func == c.function_name && args.size() == c.params.size();
+  }
+
+  void collect_usage(VariableUsage& usage) const override {
+    for (const auto& arg : args) {
+      arg->collect_usage(usage);
+    }
+    if (!builtin_functions.count({func, args.size()})) {
+      usage.call();
     }
-    if (!args.empty()) {
-      c.code.push_back("set R0 " + std::to_string(args.size() * 4));
-      c.code.emplace_back("add RS R0");
-      c.extra_offset -= args.size();
+  }
+
+  void simplify(expr_ptr_t& self) override {
+    for (auto& arg : args) {
+      arg->simplify(arg);
     }
   }
+
+ private:
+  std::string label() const {
+    return "@func_" + func + '_' + std::to_string(args.size());
+  }
+
+  void assemble_builtin(CompilationContext& c, uint8_t out, const std::string& command) const {
+    size_t temp_count = c.temp_count;
+    std::vector<uint8_t> regs;
+    for (size_t i = 0; i < args.size(); ++i) {
+      regs.push_back(c.acquire_temp());
+    }
+    if (std::find(regs.begin(), regs.end(), 0) == regs.end()) {
+      for (size_t i = 0; i < args.size(); ++i) {
+        args[i]->assemble(c, regs[i]);
+      }
+    } else {
+      // Out of temporaries: the arguments wait on the stack
+      for (const auto& arg : args) {
+        arg->assemble(c, SPILL_REG);
+        c.code.emit("push", SPILL_REG);
+        ++c.extra_offset;
+      }
+      for (size_t i = args.size(); i > 0; --i) {
+        regs[i - 1] = static_cast<uint8_t>(SPILL_REG + i);
+        c.code.emit("pop", regs[i - 1]);
+        --c.extra_offset;
+      }
+    }
+    regs.resize(3);
+    c.code.emit(command, regs[0], regs[1], regs[2]);
+    if (out) {
+      c.code.emit("mov", out, regs[0]);
+    }
+    c.temp_count = temp_count;
+  }
 };
 
 
+// A chain of IFs comparing one variable with at least this many constants jumps straight to its branch
+constexpr size_t SWITCH_MIN_CASES = 4;
+// Constants are looked up in a table if there are this many in a range at most twice their number
+constexpr size_t JUMP_TABLE_MIN_CASES = 4;
+// Up to this many constants outside of tables are compared one by one instead of searched
+constexpr size_t LINEAR_SEARCH_LIMIT = 3;
+
+// Collects the constants `e` compares `name` with, if `e` is true exactly when the variable is one of them.
+// The variable is that of the first comparison if `name` is not set yet.
+bool collect_cases(const Expression& e, const NameExpression*& name, std::vector<int32_t>& values) {
+  auto logical = dynamic_cast<const LogicalExpression*>(&e);
+  if (logical && logical->op == '|') {
+    return collect_cases(*logical->left, name, values) && collect_cases(*logical->right, name, values);
+  }
+  auto bin = dynamic_cast<const BinExpression*>(&e);
+  if (bin && bin->op == '|') {
+    return collect_cases(*bin->left, name, values) && collect_cases(*bin->right, name, values);
+  }
+  int32_t value = 0;
+  auto variable = bin && bin->op == '=' ? dynamic_cast<const NameExpression*>(bin->left.get()) : nullptr;
+  if (!variable || !bin->right->get_constant(value) || (name && name->name != variable->name)) {
+    return false;
+  }
+  name = variable;
+  values.push_back(value);
+  return true;
+}
+
+// Jumps from the value in R1 to the label of the branch for it. Dense ranges of constants are looked up in a
+// table of addresses, and the ranges are found by binary search. The search compares without sign, so
+// values are offset by 2^31 first to keep their order.
+struct SwitchDispatch {
+  std::map<int32_t, size_t> cases{};
+  std::vector<std::string> labels{};
+  std::string label_default{};
+  std::string label_base{};
+
+  void assemble(CompilationContext& c) {
+    std::vector<int32_t> values;
+    for (const auto& entry : cases) {
+      values.push_back(entry.first);
+    }
+    for (size_t i = 0; i < values.size();) {
+      size_t end = i + 1;
+      for (size_t j = i + JUMP_TABLE_MIN_CASES - 1; j < values.size(); ++j) {
+        if (int64_t{values[j]} - values[i] + 1 <= 2 * static_cast<int64_t>(j - i + 1)) {
+          end = j + 1;
+        }
+      }
+      ranges.emplace_back(values[i], values[end - 1]);
+      i = end;
+    }
+    if (ranges.size() > 1 && !is_linear(0, ranges.size())) {
+      offset = std::numeric_limits<int32_t>::min();
+      c.code.emit_value("set", 0, offset);
+      c.code.emit("xor", 1, 0);
+    }
+    search(c, 0, ranges.size());
+  }
+
+ private:
+  bool is_linear(size_t begin, size_t end) const {
+    return end - begin <= LINEAR_SEARCH_LIMIT && std::all_of(ranges.begin() + static_cast<ptrdiff_t>(begin),
+                                                             ranges.begin() + static_cast<ptrdiff_t>(end),
+                                                             [](const std::pair<int32_t, int32_t>& range) {
+                                                               return range.first == range.second;
+                                                             });
+  }
+
+  // The constant as it is compared with the value in R1
+  int32_t key(int32_t value) const {
+    return value ^ offset;
+  }
+
+  void search(CompilationContext& c, size_t begin, size_t end) {
+    if (end - begin == 1 && ranges[begin].first != ranges[begin].second) {
+      assemble_table(c, begin);
+      return;
+    }
+    if (is_linear(begin, end)) {
+      for (size_t i = begin; i < end; ++i) {
+        c.code.emit_value("set", 0, key(ranges[i].first));
+        c.code.emit("xor", 0, 1);
+        c.code.emit_jump("jiz", labels[cases.at(ranges[i].first)]);
+      }
+      c.code.emit_jump("jmp", label_default);
+      return;
+    }
+    // Borrows when the value is at least the first constant of the upper half
+    size_t middle = (begin + end) / 2;
+    std::string label_upper = "@upper" + label_base + "_" + std::to_string(middle);
+    c.code.emit_value("set", 0, key(ranges[middle].first - 1));
+    c.code.emit("sub", 0, 1);
+    c.code.emit_jump("jio", label_upper);
+    search(c, begin, middle);
+    c.code.label(label_upper);
+    search(c, middle, end);
+  }
+
+  // The value less the first constant is the index in the table, unless it borrows past the last entry
+  void assemble_table(CompilationContext& c, size_t index) {
+    int32_t low = ranges[index].first;
+    int32_t high = ranges[index].second;
+    std::vector<std::string> table;
+    for (int64_t value = low; value <= high; ++value) {
+      auto it = cases.find(static_cast<int32_t>(value));
+      table.push_back(it != cases.end() ? labels[it->second] : label_default);
+    }
+    std::string label_table = "@table" + label_base + "_" + std::to_string(index);
+    if (key(low)) {
+      c.code.emit_value("set", 0, key(low));
+      c.code.emit("sub", 1, 0);
+    }
+    c.code.emit_value("set", 0, static_cast<int32_t>(table.size() - 1));
+    c.code.emit("sub", 0, 1);
+    c.code.emit_jump("jio", label_default);
+    c.code.emit_value("set", 0, 2);
+    c.code.emit("shift", 1, 0);
+    c.code.emit_address("set", 0, label_table);
+    c.code.emit("add", 1, 0);
+    c.code.emit("load32", 1, 1);
+    c.code.emit("jmpr", 1);
+    c.code.table(label_table, table);
+  }
+
+  std::vector<std::pair<int32_t, int32_t>> ranges{};
+  int32_t offset{0};
+};
+
 struct IfNode : public ASTNode {
   expr_ptr_t condition{nullptr};
   std::vector<node_ptr_t> body{};
   std::vector<node_ptr_t> else_body{};
 
   void assemble(CompilationContext& c) const override {
-    condition->assemble(c, 1);
+    if (assemble_switch(c)) {
+      return;
+    }
     std::string label_end = "@endif" + std::to_string(c.code.size());
     std::string label_else = "@else" + std::to_string(c.code.size());
-    c.code.emplace_back("and R1 R1");
     if (!else_body.empty()) {
-      c.code.push_back("jiz " + label_else);
+      condition->assemble_branch(c, 1, false, label_else);
       for (const auto& o : body) {
         o->assemble(c);
       }
-      c.code.push_back("jmp " + label_end);
-      c.code.push_back(label_else);
+      c.code.emit_jump("jmp", label_end);
+      c.code.label(label_else);
       for (const auto& o : else_body) {
         o->assemble(c);
       }
-      c.code.push_back(label_end);
+      c.code.label(label_end);
     } else {
-      c.code.push_back("jiz " + label_end);
+      condition->assemble_branch(c, 1, false, label_end);
       for (const auto& o : body) {
         o->assemble(c);
       }
-      c.code.push_back(label_end);
+      c.code.label(label_end);
+    }
+  }
+
+  // A switch reads its variable once, before any branch
+  void collect_usage(VariableUsage& usage) const override {
+    const NameExpression* name = nullptr;
+    SwitchDispatch dispatch;
+    std::vector<const std::vector<node_ptr_t>*> branches;
+    const std::vector<node_ptr_t>* default_body = nullptr;
+    if (find_switch(name, dispatch, branches, default_body)) {
+      name->collect_usage(usage);
+      for (auto branch : branches) {
+        collect_nodes_usage(usage, *branch);
+      }
+      collect_nodes_usage(usage, *default_body);
+      return;
+    }
+    condition->collect_usage(usage);
+    collect_nodes_usage(usage, body);
+    collect_nodes_usage(usage, else_body);
+  }
+
+  void simplify() override {
+    condition->simplify(condition);
+    simplify_nodes(body);
+    simplify_nodes(else_body);
+  }
+
+ private:
+  // An IF whose ELSE is only another IF, down a chain where each compares the same variable with constants,
+  // as SWITCH does, is compiled as a switch. Returns false for any other IF.
+  bool find_switch(const NameExpression*& name, SwitchDispatch& dispatch,
+                   std::vector<const std::vector<node_ptr_t>*>& branches,
+                   const std::vector<node_ptr_t>*& default_body) const {
+    std::vector<int32_t> values;
+    for (const IfNode* node = this; node && collect_cases(*node->condition, name, values);) {
+      // A constant compared again in a later IF never gets there
+      for (auto value : values) {
+        dispatch.cases.emplace(value, branches.size());
+      }
+      values.clear();
+      branches.push_back(&node->body);
+      default_body = &node->else_body;
+      node = default_body->size() == 1 ? dynamic_cast<const IfNode*>(default_body->front().get()) : nullptr;
+    }
+    return dispatch.cases.size() >= SWITCH_MIN_CASES;
+  }
+
+  // Returns false, having emitted nothing, if the IF is not a switch
+  bool assemble_switch(CompilationContext& c) const {
+    const NameExpression* name = nullptr;
+    SwitchDispatch dispatch;
+    std::vector<const std::vector<node_ptr_t>*> branches;
+    const std::vector<node_ptr_t>* default_body = nullptr;
+    if (!find_switch(name, dispatch, branches, default_body)) {
+      return false;
+    }
+    dispatch.label_base = std::to_string(++c.label_count);
+    for (size_t i = 0; i < branches.size(); ++i) {
+      dispatch.labels.push_back("@case" + dispatch.label_base + "_" + std::to_string(i));
+    }
+    dispatch.label_default = "@default" + dispatch.label_base;
+    std::string label_end = "@endswitch" + dispatch.label_base;
+    name->assemble(c, 1);
+    dispatch.assemble(c);
+    for (size_t i = 0; i < branches.size(); ++i) {
+      c.code.label(dispatch.labels[i]);
+      for (const auto& o : *branches[i]) {
+        o->assemble(c);
+      }
+      if (i + 1 < branches.size() || !default_body->empty()) {
+        c.code.emit_jump("jmp", label_end);
+      }
+    }
+    c.code.label(dispatch.label_default);
+    for (const auto& o : *default_body) {
+      o->assemble(c);
     }
+    c.code.label(label_end);
+    return true;
   }
 };
 
@@ -273,18 +1166,28 @@ struct WhileNode : public ASTNode {
     auto old_end = c.loop_end_label;
     c.loop_end_label = "@endloop" + std::to_string(c.code.size());
     c.loop_start_label = "@loop" + std::to_string(c.code.size());
-    c.code.emplace_back(c.loop_start_label);
-    condition->assemble(c, 2);
-    c.code.emplace_back("and R2 R2");
-    c.code.emplace_back("jiz " + c.loop_end_label);
+    c.code.label(c.loop_start_label);
+    condition->assemble_branch(c, 2, false, c.loop_end_label);
     for (const auto& o : body) {
       o->assemble(c);
     }
-    c.code.push_back("jmp " + c.loop_start_label);
-    c.code.push_back(c.loop_end_label);
+    c.code.emit_jump("jmp", c.loop_start_label);
+    c.code.label(c.loop_end_label);
     c.loop_start_label = old_start;
     c.loop_end_label = old_end;
   }
+
+  void collect_usage(VariableUsage& usage) const override {
+    size_t start = usage.position;
+    condition->collect_usage(usage);
+    collect_nodes_usage(usage, body);
+    usage.leave_loop(start);
+  }
+
+  void simplify() override {
+    condition->simplify(condition);
+    simplify_nodes(body);
+  }
 };
 
 struct ForNode: public ASTNode {
@@ -300,52 +1203,97 @@ struct ForNode: public ASTNode {
     c.loop_end_label = "@endfor" + std::to_string(c.code.size());
     c.loop_start_label = "@incfor" + std::to_string(c.code.size());
     auto loop_real_start = "@for" + std::to_string(c.code.size());
+    if (uint8_t reg = var->get_register(c)) {
+      num_start->assemble(c, reg);
+      c.code.label(loop_real_start);
+      num_end->assemble_branch(c, 8, false, c.loop_end_label);
+      for (const auto& o : body) {
+        o->assemble(c);
+      }
+      c.code.label(c.loop_start_label);
+      num_step->assemble(c, 8);
+      c.code.emit("add", reg, 8);
+      c.code.emit_jump("jmp", loop_real_start);
+      c.code.label(c.loop_end_label);
+      c.loop_start_label = old_start;
+      c.loop_end_label = old_end;
+      return;
+    }
     var->get_address(c, 7);
-    c.code.emplace_back("push R7");
+    c.code.emit("push", 7);
     ++c.extra_offset;
     num_start->assemble(c, 8);
-    c.code.emplace_back("load32 R7 RS");
-    c.code.emplace_back("store32 R7 R8");
-    c.code.push_back(loop_real_start);
+    c.code.emit("load32", 7, REG_STACK);
+    c.code.emit("store32", 7, 8);
+    c.code.label(loop_real_start);
 
-    num_end->assemble(c, 8);
-    c.code.emplace_back("and R8 R8");
-    c.code.push_back("jiz " + c.loop_end_label);
+    num_end->assemble_branch(c, 8, false, c.loop_end_label);
     for (const auto& o : body) {
       o->assemble(c);
     }
 
-    c.code.push_back(c.loop_start_label);
+    c.code.label(c.loop_start_label);
     num_step->assemble(c, 8);
-    c.code.emplace_back("load32 R7 RS");
-    c.code.emplace_back("load32 R9 R7");
-    c.code.emplace_back("add R9 R8");
-    c.code.emplace_back("store32 R7 R9");
-    c.code.push_back("jmp " + loop_real_start);
-    c.code.push_back(c.loop_end_label);
-    c.code.emplace_back("pop R0");
+    c.code.emit("load32", 7, REG_STACK);
+    c.code.emit("load32", 9, 7);
+    c.code.emit("add", 9, 8);
+    c.code.emit("store32", 7, 9);
+    c.code.emit_jump("jmp", loop_real_start);
+    c.code.label(c.loop_end_label);
+    c.code.emit("pop", 0);
     --c.extra_offset;
     c.loop_start_label = old_start;
     c.loop_end_label = old_end;
   }
 
+  void collect_usage(VariableUsage& usage) const override {
+    var->collect_usage(usage);
+    num_start->collect_usage(usage);
+    size_t start = usage.position;
+    num_end->collect_usage(usage);
+    collect_nodes_usage(usage, body);
+    num_step->collect_usage(usage);
+    var->collect_usage(usage);
+    usage.leave_loop(start);
+  }
+
+  void simplify() override {
+    var->simplify(var);
+    num_start->simplify(num_start);
+    num_end->simplify(num_end);
+    num_step->simplify(num_step);
+    simplify_nodes(body);
+  }
 };
 
 struct ReturnNode : public ASTNode {
   expr_ptr_t value{nullptr};
 
   void assemble(CompilationContext& c) const override {
+    if (value && c.tail_calls.count(value.get()) &&
+        static_cast<const CallExpression&>(*value).assemble_tail_call(c)) {
+      return;
+    }
     if (value) {
       value->assemble(c, 3);
     }
-    if (c.local_count + c.extra_offset) {
-      c.code.push_back("set R0 " + std::to_string((c.local_count + c.extra_offset) * 4));
-      c.code.emplace_back("add RS R0");
+    release_frame(c);
+    if (value) {
+      c.code.emit("mov", 0, 3);
+    }
+    c.code.emit("ret");
+  }
+
+  void collect_usage(VariableUsage& usage) const override {
+    if (value) {
+      value->collect_usage(usage);
     }
+  }
+
+  void simplify() override {
     if (value) {
-      c.code.emplace_back("mov R0 R3");
+      value->simplify(value);
     }
-    c.code.emplace_back("ret");
   }
 };
 
@@ -354,7 +1302,13 @@ struct BreakNode : public ASTNode {
     if (c.loop_end_label.empty()) {
       throw compile_error("BREAK outside loop");
     }
-    c.code.push_back("jmp " + c.loop_end_label);
+    c.code.emit_jump("jmp", c.loop_end_label);
+  }
+
+  void collect_usage(VariableUsage& usage) const override {
+  }
+
+  void simplify() override {
   }
 };
 
@@ -363,7 +1317,13 @@ struct ContinueNode : public ASTNode {
     if (c.loop_start_label.empty()) {
       throw compile_error("CONTINUE outside loop");
     }
-    c.code.push_back("jmp " + c.loop_start_label);
+    c.code.emit_jump("jmp", c.loop_start_label);
+  }
+
+  void collect_usage(VariableUsage& usage) const override {
+  }
+
+  void simplify() override {
   }
 };
 
@@ -372,13 +1332,35 @@ struct AssignNode : public ASTNode {
   expr_ptr_t value{nullptr};
 
   void assemble(CompilationContext& c) const override {
+    if (uint8_t reg = target->get_register(c)) {
+      value->assemble(c, reg);
+      return;
+    }
+    if (uint8_t address = c.acquire_temp()) {
+      target->get_address(c, address);
+      value->assemble(c, 4);
+      c.code.emit("store32", address, 4);
+      c.release_temp();
+      return;
+    }
     target->get_address(c, 4);
-    c.code.emplace_back("push R4");
+    c.code.emit("push", 4);
     ++c.extra_offset;
     value->assemble(c, 4);
-    c.code.emplace_back("pop R0");
+    c.code.emit("pop", 0);
     --c.extra_offset;
-    c.code.emplace_back("store32 R0 R4");
+    c.code.emit("store32", 0, 4);
+  }
+
+  // The target is written after the value is computed
+  void collect_usage(VariableUsage& usage) const override {
+    value->collect_usage(usage);
+    target->collect_usage(usage);
+  }
+
+  void simplify() override {
+    target->simplify(target);
+    value->simplify(value);
   }
 };
 
@@ -386,11 +1368,46 @@ struct ExecNode : public ASTNode {
   expr_ptr_t expr{nullptr};
 
   void assemble(CompilationContext& c) const override {
+    if (c.tail_calls.count(expr.get()) && static_cast<const CallExpression&>(*expr).assemble_tail_call(c)) {
+      return;
+    }
     expr->assemble(c, 0);
   }
+
+  void collect_usage(VariableUsage& usage) const override {
+    expr->collect_usage(usage);
+  }
+
+  void simplify() override {
+    expr->simplify(expr);
+  }
 };
 
 
+// Calls whose value the function returns: those of RETURN, and a call that is the last statement run
+void collect_tail_calls(const std::vector<node_ptr_t>& nodes, bool last, std::set<const Expression*>& calls) {
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    const ASTNode* node = nodes[i].get();
+    bool is_last = last && i + 1 == nodes.size();
+    if (auto return_node = dynamic_cast<const ReturnNode*>(node)) {
+      if (dynamic_cast<const CallExpression*>(return_node->value.get())) {
+        calls.insert(return_node->value.get());
+      }
+    } else if (auto exec = dynamic_cast<const ExecNode*>(node)) {
+      if (is_last && dynamic_cast<const CallExpression*>(exec->expr.get())) {
+        calls.insert(exec->expr.get());
+      }
+    } else if (auto if_node = dynamic_cast<const IfNode*>(node)) {
+      collect_tail_calls(if_node->body, is_last, calls);
+      collect_tail_calls(if_node->else_body, is_last, calls);
+    } else if (auto while_node = dynamic_cast<const WhileNode*>(node)) {
+      collect_tail_calls(while_node->body, false, calls);
+    } else if (auto for_node = dynamic_cast<const ForNode*>(node)) {
+      collect_tail_calls(for_node->body, false, calls);
+    }
+  }
+}
+
 struct Function {
 
   std::string name;
@@ -399,34 +1416,95 @@ struct Function {
   std::set<std::pair<std::string, size_t>> called;
   std::vector<node_ptr_t> body;
 
+  void simplify() {
+    simplify_nodes(body);
+  }
+
+  bool takes_parameter_address() const {
+    VariableUsage usage;
+    collect_nodes_usage(usage, body);
+    return std::any_of(params.begin(), params.end(), [&](const std::string& p) {
+      return usage.address_taken.count(p) != 0;
+    });
+  }
+
+  // Frame, from the top of the stack: locals kept in memory, saved registers, return address, parameters
   void assemble(CompilationContext& c) const {
-    c.local_count = locals.size();
+    VariableUsage usage;
+    collect_nodes_usage(usage, body);
+    size_t passed = c.passed_in_registers(name, params.size());
+    std::vector<std::string> passed_params(params.begin(), params.begin() + static_cast<ptrdiff_t>(passed));
+    RegisterAllocation allocation = allocate_registers(usage, params, passed_params);
+    c.registers = allocation.registers;
+    c.saved_registers = allocation.used;
     c.extra_offset = 0;
+    c.temp_count = 0;
+    c.saved_temp_count = 0;
     c.loop_start_label = "";
     c.loop_end_label = "";
+    c.function_name = name;
+    c.params = params;
+    c.start_label = "@start_" + name + "_" + std::to_string(params.size());
+    c.tail_calls.clear();
+    collect_tail_calls(body, true, c.tail_calls);
     c.offsets.clear();
+    // Parameters passed in registers and left without one are kept with the locals
     size_t num = 0;
-    for (const auto& p : params) {
-      c.offsets[p] = locals.size() + params.size() - num++;
-    }
-    num = 0;
     for (const auto& l : locals) {
-      c.offsets[l] = num++;
+      if (!c.registers.count(l) && usage.intervals.count(l)) {
+        c.offsets[l] = num++;
+      }
+    }
+    for (const auto& p : passed_params) {
+      if (!c.registers.count(p) && usage.intervals.count(p)) {
+        c.offsets[p] = num++;
+      }
     }
-    c.code.emplace_back("");
-    c.code.push_back("@func_" + name + "_" + std::to_string(params.size()));
-    if (!locals.empty()) {
-      c.code.push_back("set R5 " + std::to_string(4 * locals.size()));
-      c.code.emplace_back("sub RS R5");
+    c.local_count = num;
+    for (size_t i = passed; i < params.size(); ++i) {
+      c.offsets[params[i]] = c.local_count + c.saved_registers.size() + params.size() - i;
+    }
+    c.code.label("@func_" + name + "_" + std::to_string(params.size()));
+    for (auto reg : c.saved_registers) {
+      c.code.emit("push", reg);
+    }
+    if (c.local_count) {
+      c.code.emit_value("set", 5, 4 * c.local_count);
+      c.code.emit("sub", REG_STACK, 5);
+    }
+    for (size_t i = 0; i < passed; ++i) {
+      auto arg_reg = static_cast<uint8_t>(FIRST_ARG_REG + i);
+      auto reg = c.registers.find(params[i]);
+      if (reg != c.registers.end()) {
+        if (reg->second != arg_reg) {
+          c.code.emit("mov", reg->second, arg_reg);
+        }
+      } else if (c.offsets.count(params[i])) {
+        c.code.emit_value("set", 0, c.offsets.at(params[i]) * 4);
+        c.code.emit("add", 0, REG_STACK);
+        c.code.emit("store32", 0, arg_reg);
+      }
+    }
+    for (size_t i = passed; i < params.size(); ++i) {
+      const auto& p = params[i];
+      if (c.registers.count(p)) {
+        uint8_t reg = c.registers.at(p);
+        c.code.emit_value("set", reg, c.offsets.at(p) * 4);
+        c.code.emit("add", reg, REG_STACK);
+        c.code.emit("load32", reg, reg);
+      }
+    }
+    bool recursive = std::any_of(c.tail_calls.begin(), c.tail_calls.end(), [&](const Expression* call) {
+      return static_cast<const CallExpression*>(call)->is_recursive(c);
+    });
+    if (recursive) {
+      c.code.label(c.start_label);
     }
     for (const auto& op : body) {
       op->assemble(c);
     }
-    if (!locals.empty()) {
-      c.code.push_back("set R5 " + std::to_string(4 * locals.size()));
-      c.code.emplace_back("add RS R5");
-    }
-    c.code.emplace_back("ret");
+    release_frame(c);
+    c.code.emit("ret");
   }
 
 };
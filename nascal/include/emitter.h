@@ -0,0 +1,280 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <set>
+#include <tuple>
+#include <vector>
+#include "cpu.h"
+#include "object.h"
+
+// Generated code is kept as instructions, not text. It is encoded straight into an image or an object
+// file, with opcodes from CPU::commands and labels resolved here, or printed as assembly.
+// Tables of code addresses go to the read-only data section.
+
+enum class line_kind {
+  INSTRUCTION, LABEL, GLOBAL, WORD
+};
+
+struct CodeLine {
+  line_kind kind{line_kind::INSTRUCTION};
+  uint8_t command{0};
+  std::array<uint8_t, 3> registers{{0, 0, 0}};
+  int32_t value{0};
+  // Label the instruction or the word refers to, or the label declared or exported by the line
+  std::string label{};
+  section_kind section{section_kind::CODE};
+
+  const Command& get_command() const {
+    return CPU::commands[command];
+  }
+};
+
+class Code {
+
+ public:
+  void emit(const std::string& mnemonic, uint8_t reg1 = 0, uint8_t reg2 = 0, uint8_t reg3 = 0) {
+    CodeLine line;
+    line.command = opcode(mnemonic);
+    line.registers = {{reg1, reg2, reg3}};
+    lines.push_back(std::move(line));
+  }
+
+  void emit_value(const std::string& mnemonic, uint8_t reg, int32_t value) {
+    CodeLine line;
+    line.command = opcode(mnemonic);
+    line.registers[0] = reg;
+    line.value = value;
+    lines.push_back(std::move(line));
+  }
+
+  void emit_jump(const std::string& mnemonic, const std::string& label) {
+    CodeLine line;
+    line.command = opcode(mnemonic);
+    line.label = label;
+    lines.push_back(std::move(line));
+  }
+
+  // Sets `reg` to the address of `label`
+  void emit_address(const std::string& mnemonic, uint8_t reg, const std::string& label) {
+    CodeLine line;
+    line.command = opcode(mnemonic);
+    line.registers[0] = reg;
+    line.label = label;
+    lines.push_back(std::move(line));
+  }
+
+  void label(const std::string& name) {
+    lines.push_back(CodeLine{line_kind::LABEL, 0, {{0, 0, 0}}, 0, name});
+  }
+
+  void global(const std::string& name) {
+    lines.push_back(CodeLine{line_kind::GLOBAL, 0, {{0, 0, 0}}, 0, name});
+  }
+
+  // Read-only words holding the addresses of `labels`, starting at label `name`
+  void table(const std::string& name, const std::vector<std::string>& labels) {
+    lines.push_back(CodeLine{line_kind::LABEL, 0, {{0, 0, 0}}, 0, name, section_kind::RODATA});
+    for (const auto& label : labels) {
+      lines.push_back(CodeLine{line_kind::WORD, 0, {{0, 0, 0}}, 0, label, section_kind::RODATA});
+    }
+  }
+
+  size_t size() const {
+    return lines.size();
+  }
+
+  const std::vector<CodeLine>& get_lines() const {
+    return lines;
+  }
+
+ private:
+  static uint8_t opcode(const std::string& mnemonic) {
+    static const std::map<std::string, uint8_t> opcodes = []() {
+      std::map<std::string, uint8_t> res;
+      for (size_t i = 0; i < CPU::commands.size(); ++i) {
+        res.emplace(CPU::commands[i].mnemonic, static_cast<uint8_t>(i));
+      }
+      return res;
+    }();
+    return opcodes.at(mnemonic);
+  }
+
+  std::vector<CodeLine> lines{};
+};
+
+
+namespace emitter_detail {
+
+size_t register_count(command_type type) {
+  switch (type) {
+    case command_type::REG:
+    case command_type::REGVAL:
+    case command_type::REGVAL8:
+    case command_type::REGVAL16:
+      return 1;
+    case command_type::REGREG:
+    case command_type::VECVEC:
+    case command_type::VECREG:
+    case command_type::REGVEC:
+      return 2;
+    case command_type::REGREGREG:
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+// Only the full-size forms are generated, so every operand is 32 bits
+bool has_operand(command_type type) {
+  return type == command_type::REGVAL || type == command_type::LABEL;
+}
+
+void put_uint32(std::vector<uint8_t>& out, size_t position, uint32_t num) {
+  for (size_t i = 0; i < 4; ++i) {
+    out[position + i] = static_cast<uint8_t>(num >> (8 * i));
+  }
+}
+
+struct Label {
+  section_kind section;
+  uint32_t offset;
+};
+
+struct Reference {
+  section_kind section;
+  uint32_t position;
+  std::string label;
+};
+
+// Encodes the lines of one section; references to labels are returned with the position of their operand
+std::vector<uint8_t> encode_section(const std::vector<CodeLine>& lines, section_kind section,
+                                    std::map<std::string, Label>& labels, std::vector<Reference>& references) {
+  std::vector<uint8_t> code;
+  for (const auto& line : lines) {
+    if (line.section != section) {
+      continue;
+    }
+    if (line.kind == line_kind::LABEL) {
+      if (!labels.emplace(line.label, Label{section, static_cast<uint32_t>(code.size())}).second) {
+        throw std::runtime_error("Label redeclared: " + line.label);
+      }
+      continue;
+    }
+    if (line.kind == line_kind::WORD) {
+      references.push_back({section, static_cast<uint32_t>(code.size()), line.label});
+      code.resize(code.size() + 4);
+      continue;
+    }
+    if (line.kind != line_kind::INSTRUCTION) {
+      continue;
+    }
+    command_type type = line.get_command().type;
+    code.push_back(line.command);
+    for (size_t i = 0; i < register_count(type); ++i) {
+      code.push_back(line.registers[i]);
+    }
+    if (has_operand(type)) {
+      if (!line.label.empty()) {
+        references.push_back({section, static_cast<uint32_t>(code.size()), line.label});
+      }
+      code.resize(code.size() + 4);
+      put_uint32(code, code.size() - 4, static_cast<uint32_t>(line.value));
+    }
+  }
+  return code;
+}
+
+void append_register(std::string& out, uint8_t reg) {
+  out += reg == REG_STACK ? "RS" : reg == REG_INSTRUCTION ? "RI" : "R" + std::to_string(reg);
+}
+
+}
+
+
+std::vector<uint8_t> encode_image(const std::vector<CodeLine>& lines) {
+  using namespace emitter_detail;
+  std::map<std::string, Label> labels;
+  std::vector<Reference> references;
+  Image image;
+  image.code = encode_section(lines, section_kind::CODE, labels, references);
+  image.rodata = encode_section(lines, section_kind::RODATA, labels, references);
+  for (const auto& reference : references) {
+    auto label = labels.find(reference.label);
+    if (label == labels.end()) {
+      throw std::runtime_error("Label not declared: " + reference.label);
+    }
+    put_uint32(image.section(reference.section), reference.position,
+               image.address(label->second.section, label->second.offset));
+  }
+  return write_image(image);
+}
+
+// Every label address is left to the linker, as `assembler -c` does
+std::vector<uint8_t> encode_object(const std::vector<CodeLine>& lines) {
+  using namespace emitter_detail;
+  std::map<std::string, Label> labels;
+  std::vector<Reference> references;
+  ObjectFile object;
+  object.code = encode_section(lines, section_kind::CODE, labels, references);
+  object.rodata = encode_section(lines, section_kind::RODATA, labels, references);
+  std::set<std::string> globals;
+  for (const auto& line : lines) {
+    if (line.kind == line_kind::GLOBAL) {
+      if (!labels.count(line.label)) {
+        throw std::runtime_error("Label not declared: " + line.label);
+      }
+      globals.insert(line.label);
+    }
+  }
+  for (const auto& label : labels) {
+    object.symbols.push_back({label.first, label.second.offset, globals.count(label.first) != 0,
+                              label.second.section});
+  }
+  std::sort(object.symbols.begin(), object.symbols.end(), [](const ObjectSymbol& a, const ObjectSymbol& b) {
+    return std::tie(a.section, a.offset, a.name) < std::tie(b.section, b.offset, b.name);
+  });
+  for (const auto& reference : references) {
+    object.relocations.push_back({reference.position, reference.label, reference.section});
+  }
+  return write_object(object);
+}
+
+void write_assembly(const std::vector<CodeLine>& lines, std::ostream& out) {
+  using namespace emitter_detail;
+  std::string text;
+  section_kind section = section_kind::CODE;
+  for (const auto& line : lines) {
+    if (line.section != section) {
+      section = line.section;
+      text += section == section_kind::CODE ? ".code\n" : ".rodata\n";
+    }
+    if (line.kind == line_kind::GLOBAL) {
+      text += ".global " + line.label;
+    } else if (line.kind == line_kind::WORD) {
+      text += ".word " + line.label;
+    } else if (line.kind == line_kind::LABEL) {
+      // Functions are set apart
+      if (line.label.compare(0, 6, "@func_") == 0 && !text.empty()) {
+        text += '\n';
+      }
+      text += line.label;
+    } else {
+      command_type type = line.get_command().type;
+      text += line.get_command().mnemonic;
+      for (size_t i = 0; i < register_count(type); ++i) {
+        text += ' ';
+        append_register(text, line.registers[i]);
+      }
+      if (has_operand(type)) {
+        text += ' ';
+        text += line.label.empty() ? std::to_string(line.value) : line.label;
+      }
+    }
+    text += '\n';
+  }
+  out << text;
+}
@@ -0,0 +1,480 @@
+#pragma once
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "optimizer.h"
+
+// Inlining of small functions. The code of an inlined call assigns the arguments to copies of the parameters
+// and runs a copy of the callee body, with every variable renamed, before the statement making the call;
+// the call itself is replaced by a variable assigned where the callee returned.
+// There is no jump out of a block, so statements following a RETURN are moved into the branch that does not
+// return; a callee with RETURN inside a loop, or in both branches of an IF with more code after it, is not inlined.
+
+// Statements and expressions in a callee
+constexpr size_t INLINE_SIZE_LIMIT = 40;
+// Levels of calls inlined into inlined code
+constexpr size_t INLINE_DEPTH_LIMIT = 3;
+// Statements and expressions a function may grow to by inlining
+constexpr size_t INLINE_GROWTH_LIMIT = 2000;
+
+namespace inliner_detail {
+
+using renames_t = std::map<std::string, std::string>;
+
+// Calls `on_expression` on the expressions of a statement and `on_nodes` on the statement lists inside it
+void for_each_part(ASTNode& node, const std::function<void(expr_ptr_t&)>& on_expression,
+                   const std::function<void(std::vector<node_ptr_t>&)>& on_nodes) {
+  if (auto assign = dynamic_cast<AssignNode*>(&node)) {
+    on_expression(assign->target);
+    on_expression(assign->value);
+  } else if (auto exec = dynamic_cast<ExecNode*>(&node)) {
+    on_expression(exec->expr);
+  } else if (auto return_node = dynamic_cast<ReturnNode*>(&node)) {
+    if (return_node->value) {
+      on_expression(return_node->value);
+    }
+  } else if (auto if_node = dynamic_cast<IfNode*>(&node)) {
+    on_expression(if_node->condition);
+    on_nodes(if_node->body);
+    on_nodes(if_node->else_body);
+  } else if (auto while_node = dynamic_cast<WhileNode*>(&node)) {
+    on_expression(while_node->condition);
+    on_nodes(while_node->body);
+  } else if (auto for_node = dynamic_cast<ForNode*>(&node)) {
+    on_expression(for_node->var);
+    on_expression(for_node->num_start);
+    on_expression(for_node->num_end);
+    on_expression(for_node->num_step);
+    on_nodes(for_node->body);
+  }
+}
+
+size_t size_of(Expression& e) {
+  size_t size = 1;
+  optimizer_detail::for_each_operand(e, [&](expr_ptr_t& operand) {
+    size += size_of(*operand);
+  });
+  return size;
+}
+
+size_t size_of(std::vector<node_ptr_t>& nodes) {
+  size_t size = 0;
+  for (auto& node : nodes) {
+    ++size;
+    for_each_part(*node, [&](expr_ptr_t& e) {
+      size += size_of(*e);
+    }, [&](std::vector<node_ptr_t>& inner) {
+      size += size_of(inner);
+    });
+  }
+  return size;
+}
+
+expr_ptr_t clone(const Expression& e, const renames_t& renames) {
+  int32_t value = 0;
+  if (e.get_constant(value)) {
+    return make_int(value);
+  }
+  if (auto name = dynamic_cast<const NameExpression*>(&e)) {
+    auto it = renames.find(name->name);
+    return optimizer_detail::make_name(it != renames.end() ? it->second : name->name);
+  }
+  if (auto bin = dynamic_cast<const BinExpression*>(&e)) {
+    auto res = std::make_unique<BinExpression>();
+    res->op = bin->op;
+    res->left = clone(*bin->left, renames);
+    res->right = clone(*bin->right, renames);
+    return res;
+  }
+  if (auto logical = dynamic_cast<const LogicalExpression*>(&e)) {
+    auto res = std::make_unique<LogicalExpression>();
+    res->op = logical->op;
+    res->left = clone(*logical->left, renames);
+    res->right = clone(*logical->right, renames);
+    return res;
+  }
+  if (auto unary = dynamic_cast<const UnaryExpression*>(&e)) {
+    auto res = std::make_unique<UnaryExpression>();
+    res->op = unary->op;
+    res->operand = clone(*unary->operand, renames);
+    return res;
+  }
+  auto call = dynamic_cast<const CallExpression*>(&e);
+  assert(call);
+  auto res = std::make_unique<CallExpression>();
+  res->func = call->func;
+  for (const auto& arg : call->args) {
+    res->args.push_back(clone(*arg, renames));
+  }
+  return res;
+}
+
+std::vector<node_ptr_t> clone(const std::vector<node_ptr_t>& nodes, const renames_t& renames);
+
+node_ptr_t clone(const ASTNode& node, const renames_t& renames) {
+  if (auto assign = dynamic_cast<const AssignNode*>(&node)) {
+    auto res = std::make_unique<AssignNode>();
+    res->target = clone(*assign->target, renames);
+    res->value = clone(*assign->value, renames);
+    return res;
+  }
+  if (auto exec = dynamic_cast<const ExecNode*>(&node)) {
+    auto res = std::make_unique<ExecNode>();
+    res->expr = clone(*exec->expr, renames);
+    return res;
+  }
+  if (auto return_node = dynamic_cast<const ReturnNode*>(&node)) {
+    auto res = std::make_unique<ReturnNode>();
+    if (return_node->value) {
+      res->value = clone(*return_node->value, renames);
+    }
+    return res;
+  }
+  if (auto if_node = dynamic_cast<const IfNode*>(&node)) {
+    auto res = std::make_unique<IfNode>();
+    res->condition = clone(*if_node->condition, renames);
+    res->body = clone(if_node->body, renames);
+    res->else_body = clone(if_node->else_body, renames);
+    return res;
+  }
+  if (auto while_node = dynamic_cast<const WhileNode*>(&node)) {
+    auto res = std::make_unique<WhileNode>();
+    res->condition = clone(*while_node->condition, renames);
+    res->body = clone(while_node->body, renames);
+    return res;
+  }
+  if (auto for_node = dynamic_cast<const ForNode*>(&node)) {
+    auto res = std::make_unique<ForNode>();
+    res->var = clone(*for_node->var, renames);
+    res->num_start = clone(*for_node->num_start, renames);
+    res->num_end = clone(*for_node->num_end, renames);
+    res->num_step = clone(*for_node->num_step, renames);
+    res->body = clone(for_node->body, renames);
+    return res;
+  }
+  if (dynamic_cast<const BreakNode*>(&node)) {
+    return std::make_unique<BreakNode>();
+  }
+  assert(dynamic_cast<const ContinueNode*>(&node));
+  return std::make_unique<ContinueNode>();
+}
+
+std::vector<node_ptr_t> clone(const std::vector<node_ptr_t>& nodes, const renames_t& renames) {
+  std::vector<node_ptr_t> res;
+  for (const auto& node : nodes) {
+    res.push_back(clone(*node, renames));
+  }
+  return res;
+}
+
+node_ptr_t make_assign(const std::string& target, expr_ptr_t value) {
+  auto assign = std::make_unique<AssignNode>();
+  assign->target = optimizer_detail::make_name(target);
+  assign->value = std::move(value);
+  return assign;
+}
+
+bool has_return(ASTNode& node) {
+  bool found = dynamic_cast<ReturnNode*>(&node) != nullptr;
+  for_each_part(node, [](expr_ptr_t&) {
+  }, [&](std::vector<node_ptr_t>& nodes) {
+    for (auto& inner : nodes) {
+      found = found || has_return(*inner);
+    }
+  });
+  return found;
+}
+
+// BREAK or CONTINUE outside a loop would leave a loop of the caller
+bool has_stray_jump(const std::vector<node_ptr_t>& nodes) {
+  for (const auto& node : nodes) {
+    if (dynamic_cast<const BreakNode*>(node.get()) || dynamic_cast<const ContinueNode*>(node.get())) {
+      return true;
+    }
+    auto if_node = dynamic_cast<const IfNode*>(node.get());
+    if (if_node && (has_stray_jump(if_node->body) || has_stray_jump(if_node->else_body))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether running `nodes` may reach their end
+bool may_fall(const std::vector<node_ptr_t>& nodes) {
+  for (const auto& node : nodes) {
+    if (dynamic_cast<const ReturnNode*>(node.get())) {
+      return false;
+    }
+    auto if_node = dynamic_cast<const IfNode*>(node.get());
+    if (if_node && !may_fall(if_node->body) && !may_fall(if_node->else_body)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Rewrites `nodes` followed by `tail` without RETURN: the returned value is assigned to `result`, if there
+// is one, and the statements after an IF that may return are moved into its branch that may not.
+// Returns false when that is impossible without copying statements.
+bool lower_returns(std::vector<node_ptr_t>& nodes, std::vector<node_ptr_t> tail, const std::string* result) {
+  nodes.insert(nodes.end(), std::make_move_iterator(tail.begin()), std::make_move_iterator(tail.end()));
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    if (auto return_node = dynamic_cast<ReturnNode*>(nodes[i].get())) {
+      expr_ptr_t value = std::move(return_node->value);
+      nodes.resize(i);
+      if (value && result) {
+        nodes.push_back(make_assign(*result, std::move(value)));
+      } else if (value && !value->is_pure()) {
+        auto exec = std::make_unique<ExecNode>();
+        exec->expr = std::move(value);
+        nodes.push_back(std::move(exec));
+      }
+      return true;
+    }
+    if (!has_return(*nodes[i])) {
+      continue;
+    }
+    auto if_node = dynamic_cast<IfNode*>(nodes[i].get());
+    if (!if_node) {
+      return false;
+    }
+    std::vector<node_ptr_t> rest(std::make_move_iterator(nodes.begin() + static_cast<ptrdiff_t>(i + 1)),
+                                 std::make_move_iterator(nodes.end()));
+    nodes.resize(i + 1);
+    bool body_falls = may_fall(if_node->body);
+    bool else_falls = may_fall(if_node->else_body);
+    if (body_falls && else_falls && !rest.empty()) {
+      return false;
+    }
+    if (!lower_returns(if_node->body, body_falls ? std::move(rest) : std::vector<node_ptr_t>{}, result)) {
+      return false;
+    }
+    return lower_returns(if_node->else_body, else_falls ? std::move(rest) : std::vector<node_ptr_t>{}, result);
+  }
+  return true;
+}
+
+}
+
+
+class Inliner {
+
+ public:
+  explicit Inliner(std::vector<Function>& functions)
+      : functions(functions) {
+    using namespace inliner_detail;
+    for (auto& f : functions) {
+      std::pair<std::string, size_t> key{f.name, f.params.size()};
+      if (builtin_functions.count(key) || size_of(f.body) > INLINE_SIZE_LIMIT || has_stray_jump(f.body)) {
+        continue;
+      }
+      std::string result = "result";
+      std::vector<node_ptr_t> lowered = clone(f.body, renames_t{});
+      if (!lower_returns(lowered, {}, &result)) {
+        continue;
+      }
+      VariableUsage usage;
+      collect_nodes_usage(usage, f.body);
+      callees.emplace(key, Callee{f.params, f.locals, clone(f.body, renames_t{}), usage.address_taken, size_of(f.body)});
+    }
+  }
+
+  void run() {
+    for (auto& f : functions) {
+      function = &f;
+      VariableUsage usage;
+      collect_nodes_usage(usage, f.body);
+      untracked = usage.address_taken;
+      size = inliner_detail::size_of(f.body);
+      stack = {{f.name, f.params.size()}};
+      inline_calls(f.body, 0);
+    }
+  }
+
+ private:
+  enum class call_use {
+    VALUE, UNUSED, RETURNED
+  };
+
+  // A copy of a function body as it was before anything was inlined into it
+  struct Callee {
+    std::vector<std::string> params;
+    std::set<std::string> locals;
+    std::vector<node_ptr_t> body;
+    std::set<std::string> address_taken;
+    size_t size;
+  };
+
+  const Callee* get_callee(const CallExpression& call, size_t depth) const {
+    std::pair<std::string, size_t> key{call.func, call.args.size()};
+    auto it = callees.find(key);
+    if (it == callees.end() || depth >= INLINE_DEPTH_LIMIT || size + it->second.size > INLINE_GROWTH_LIMIT ||
+        std::find(stack.begin(), stack.end(), key) != stack.end()) {
+      return nullptr;
+    }
+    return &it->second;
+  }
+
+  // First call in `e` that can be inlined, in the order of evaluation. The call is moved before the
+  // statement, so everything evaluated before it must give the same result after it: once a load, a call
+  // or a variable whose address is taken has been seen, no call is moved past it.
+  expr_ptr_t* find_call(expr_ptr_t& e, size_t depth, bool& blocked) {
+    auto unary = dynamic_cast<UnaryExpression*>(e.get());
+    if (unary && unary->op == '@' && optimizer_detail::variable_name(unary->operand)) {
+      return nullptr;
+    }
+    // The right operand of AND and OR may not be computed, so no call in it or after it is moved
+    if (auto logical = dynamic_cast<LogicalExpression*>(e.get())) {
+      expr_ptr_t* found = find_call(logical->left, depth, blocked);
+      blocked = true;
+      return found;
+    }
+    expr_ptr_t* found = nullptr;
+    optimizer_detail::for_each_operand(*e, [&](expr_ptr_t& operand) {
+      if (!found) {
+        found = find_call(operand, depth, blocked);
+      }
+    });
+    if (found) {
+      return found;
+    }
+    const std::string* name = optimizer_detail::variable_name(e);
+    if (auto call = dynamic_cast<CallExpression*>(e.get())) {
+      if (!blocked && get_callee(*call, depth)) {
+        return &e;
+      }
+      blocked = true;
+    } else if ((unary && unary->op == '$') || (name && untracked.count(*name))) {
+      blocked = true;
+    }
+    return nullptr;
+  }
+
+  // Returns the code of the call in `slot`, which is replaced by the variable holding its value. The value
+  // of a call made by a statement of its own is not needed, and a returned call keeps the RETURN statements
+  // of the callee, so the calls they return are still the last thing the function does.
+  std::vector<node_ptr_t> expand(expr_ptr_t& slot, call_use use, size_t depth) {
+    using namespace inliner_detail;
+    auto& call = static_cast<CallExpression&>(*slot);
+    std::pair<std::string, size_t> key{call.func, call.args.size()};
+    const Callee& callee = callees.at(key);
+    std::string result = "inline." + std::to_string(++inline_count);
+    renames_t renames;
+    for (const auto& name : callee.locals) {
+      renames[name] = result + '.' + name;
+    }
+    for (const auto& name : callee.params) {
+      renames[name] = result + '.' + name;
+    }
+    for (const auto& name : renames) {
+      function->locals.insert(name.second);
+    }
+    for (const auto& name : callee.address_taken) {
+      untracked.insert(renames.at(name));
+    }
+    std::vector<node_ptr_t> code;
+    for (size_t i = 0; i < callee.params.size(); ++i) {
+      code.push_back(make_assign(renames.at(callee.params[i]), std::move(call.args[i])));
+    }
+    std::vector<node_ptr_t> body = clone(callee.body, renames);
+    if (use == call_use::RETURNED) {
+      if (may_fall(body)) {
+        body.push_back(std::make_unique<ReturnNode>());
+      }
+    } else {
+      lower_returns(body, {}, use == call_use::VALUE ? &result : nullptr);
+    }
+    code.insert(code.end(), std::make_move_iterator(body.begin()), std::make_move_iterator(body.end()));
+    size += callee.size;
+    if (use == call_use::VALUE) {
+      function->locals.insert(result);
+      slot = optimizer_detail::make_name(result);
+    } else {
+      slot = make_int(0);
+    }
+    stack.push_back(key);
+    inline_calls(code, depth + 1);
+    stack.pop_back();
+    return code;
+  }
+
+  // Inlines the calls made by `nodes`, which are `depth` levels of inlining inside the function
+  void inline_calls(std::vector<node_ptr_t>& nodes, size_t depth) {
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      ASTNode* node = nodes[i].get();
+      // Expressions computed once, before anything else the statement does, in the order they are computed
+      std::vector<expr_ptr_t*> computed;
+      const expr_ptr_t* unused = nullptr;
+      const expr_ptr_t* returned = nullptr;
+      if (auto assign = dynamic_cast<AssignNode*>(node)) {
+        if (!optimizer_detail::variable_name(assign->target)) {
+          computed.push_back(&assign->target);
+        }
+        computed.push_back(&assign->value);
+      } else if (auto exec = dynamic_cast<ExecNode*>(node)) {
+        computed.push_back(&exec->expr);
+        unused = &exec->expr;
+      } else if (auto return_node = dynamic_cast<ReturnNode*>(node)) {
+        if (return_node->value) {
+          computed.push_back(&return_node->value);
+          returned = &return_node->value;
+        }
+      } else if (auto if_node = dynamic_cast<IfNode*>(node)) {
+        computed.push_back(&if_node->condition);
+        inline_calls(if_node->body, depth);
+        inline_calls(if_node->else_body, depth);
+      } else if (auto while_node = dynamic_cast<WhileNode*>(node)) {
+        inline_calls(while_node->body, depth);
+      } else if (auto for_node = dynamic_cast<ForNode*>(node)) {
+        if (!optimizer_detail::variable_name(for_node->var)) {
+          computed.push_back(&for_node->var);
+        }
+        computed.push_back(&for_node->num_start);
+        inline_calls(for_node->body, depth);
+      }
+      while (true) {
+        expr_ptr_t* slot = nullptr;
+        bool blocked = false;
+        for (auto e : computed) {
+          if (!slot) {
+            slot = find_call(*e, depth, blocked);
+          }
+        }
+        if (!slot) {
+          break;
+        }
+        if (slot == returned) {
+          std::vector<node_ptr_t> code = expand(*slot, call_use::RETURNED, depth);
+          nodes.erase(nodes.begin() + static_cast<ptrdiff_t>(i));
+          nodes.insert(nodes.begin() + static_cast<ptrdiff_t>(i), std::make_move_iterator(code.begin()),
+                       std::make_move_iterator(code.end()));
+          i += code.size() - 1;
+          break;
+        }
+        std::vector<node_ptr_t> code = expand(*slot, slot == unused ? call_use::UNUSED : call_use::VALUE, depth);
+        nodes.insert(nodes.begin() + static_cast<ptrdiff_t>(i), std::make_move_iterator(code.begin()),
+                     std::make_move_iterator(code.end()));
+        i += code.size();
+      }
+      auto exec = dynamic_cast<ExecNode*>(nodes[i].get());
+      if (exec && exec->expr->is_pure()) {
+        nodes.erase(nodes.begin() + static_cast<ptrdiff_t>(i--));
+      }
+    }
+  }
+
+  std::vector<Function>& functions;
+  std::map<std::pair<std::string, size_t>, Callee> callees{};
+  Function* function{nullptr};
+  std::set<std::string> untracked{};
+  size_t size{0};
+  std::vector<std::pair<std::string, size_t>> stack{};
+  size_t inline_count{0};
+};
+
+
+void inline_calls(std::vector<Function>& functions) {
+  Inliner(functions).run();
+}
@@ -0,0 +1,682 @@
+#pragma once
+#include <functional>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "ast.h"
+
+// Optimizations across statements. Control flow is only IF, WHILE and FOR, so the facts an SSA form would
+// give are found by walking the statements in order and merging them where branches and loops end.
+// Only variables whose address is never taken are followed: memory may change under any store or call,
+// so loads are never moved or reused.
+
+namespace optimizer_detail {
+
+// Calls `f` on the operands of `e`, in the order they are evaluated
+void for_each_operand(Expression& e, const std::function<void(expr_ptr_t&)>& f) {
+  if (auto bin = dynamic_cast<BinExpression*>(&e)) {
+    f(bin->right);
+    f(bin->left);
+  } else if (auto logical = dynamic_cast<LogicalExpression*>(&e)) {
+    f(logical->left);
+    f(logical->right);
+  } else if (auto unary = dynamic_cast<UnaryExpression*>(&e)) {
+    f(unary->operand);
+  } else if (auto call = dynamic_cast<CallExpression*>(&e)) {
+    for (auto& arg : call->args) {
+      f(arg);
+    }
+  }
+}
+
+std::set<std::string> variables(const Expression& e) {
+  VariableUsage usage;
+  e.collect_usage(usage);
+  std::set<std::string> names;
+  for (const auto& v : usage.intervals) {
+    names.insert(v.first);
+  }
+  return names;
+}
+
+const std::string* variable_name(const expr_ptr_t& e) {
+  auto name = dynamic_cast<const NameExpression*>(e.get());
+  return name ? &name->name : nullptr;
+}
+
+expr_ptr_t make_name(const std::string& name) {
+  auto ne = std::make_unique<NameExpression>();
+  ne->name = name;
+  return ne;
+}
+
+// Text identifying a pure expression: two expressions with the same key compute the same value
+std::string key_of(const Expression& e) {
+  int32_t value = 0;
+  if (e.get_constant(value)) {
+    return std::to_string(value);
+  }
+  if (auto name = dynamic_cast<const NameExpression*>(&e)) {
+    return name->name;
+  }
+  if (auto unary = dynamic_cast<const UnaryExpression*>(&e)) {
+    return unary->op + key_of(*unary->operand);
+  }
+  if (auto logical = dynamic_cast<const LogicalExpression*>(&e)) {
+    return '(' + key_of(*logical->left) + logical->op + logical->op + key_of(*logical->right) + ')';
+  }
+  auto bin = dynamic_cast<const BinExpression*>(&e);
+  return '(' + key_of(*bin->left) + bin->op + key_of(*bin->right) + ')';
+}
+
+}
+
+
+class FunctionOptimizer {
+
+ public:
+  explicit FunctionOptimizer(Function& function)
+      : function(function) {
+    VariableUsage usage;
+    collect_nodes_usage(usage, function.body);
+    untracked = usage.address_taken;
+  }
+
+  void run() {
+    propagate_copies(function.body, copies_t{});
+    prune(function.body);
+    remove_dead_code(function.body);
+    for_each_expression(function.body, [&](expr_ptr_t& e) {
+      short_circuit(e);
+    });
+    hoist_invariants(function.body);
+    available_t available;
+    eliminate_common_subexpressions(function.body, available);
+    // Variables that only copy a new one are not needed any more
+    propagate_copies(function.body, copies_t{});
+    remove_dead_code(function.body);
+  }
+
+ private:
+  // A variable known to hold a constant, or the value of another variable when `name` is set
+  struct Copy {
+    std::string name;
+    int32_t value;
+
+    bool operator==(const Copy& other) const {
+      return name == other.name && value == other.value;
+    }
+  };
+
+  using copies_t = std::map<std::string, Copy>;
+  using live_t = std::set<std::string>;
+
+  // First computation of an expression, and the variable holding its value once it is computed again
+  struct Available {
+    expr_ptr_t* slot;
+    std::vector<node_ptr_t>* list;
+    const ASTNode* statement;
+    std::set<std::string> variables;
+    std::string temp;
+  };
+
+  using available_t = std::map<std::string, Available*>;
+
+  // Where BREAK and CONTINUE of the innermost loop go
+  struct LoopLive {
+    live_t exit;
+    live_t next;
+  };
+
+  bool tracked(const std::string& name) const {
+    return !untracked.count(name);
+  }
+
+  const std::string* tracked_name(const expr_ptr_t& e) const {
+    const std::string* name = optimizer_detail::variable_name(e);
+    return name && tracked(*name) ? name : nullptr;
+  }
+
+  std::string new_temp(const std::string& kind) {
+    std::string name = kind + '.' + std::to_string(++temp_count);
+    function.locals.insert(name);
+    return name;
+  }
+
+  void collect_assigned(const std::vector<node_ptr_t>& nodes, std::set<std::string>& assigned) const {
+    for (const auto& node : nodes) {
+      if (auto assign = dynamic_cast<const AssignNode*>(node.get())) {
+        if (const std::string* name = optimizer_detail::variable_name(assign->target)) {
+          assigned.insert(*name);
+        }
+      } else if (auto if_node = dynamic_cast<const IfNode*>(node.get())) {
+        collect_assigned(if_node->body, assigned);
+        collect_assigned(if_node->else_body, assigned);
+      } else if (auto while_node = dynamic_cast<const WhileNode*>(node.get())) {
+        collect_assigned(while_node->body, assigned);
+      } else if (auto for_node = dynamic_cast<const ForNode*>(node.get())) {
+        if (const std::string* name = optimizer_detail::variable_name(for_node->var)) {
+          assigned.insert(*name);
+        }
+        collect_assigned(for_node->body, assigned);
+      }
+    }
+  }
+
+  // Expressions with no effects, reading only variables followed here: nothing else changes their value
+  bool is_unaffected(const expr_ptr_t& e) const {
+    if (!e->is_pure()) {
+      return false;
+    }
+    for (const auto& name : optimizer_detail::variables(*e)) {
+      if (!tracked(name)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Expressions with no effects, worth keeping in a variable, and reading only variables followed here
+  bool is_candidate(const expr_ptr_t& e) const {
+    auto unary = dynamic_cast<const UnaryExpression*>(e.get());
+    if (!dynamic_cast<const BinExpression*>(e.get()) && !(unary && unary->op != '@' && unary->op != '$')) {
+      return false;
+    }
+    return is_unaffected(e);
+  }
+
+
+  // Copy and constant propagation
+
+  void replace_copies(expr_ptr_t& e, const copies_t& copies) {
+    if (const std::string* name = tracked_name(e)) {
+      auto it = copies.find(*name);
+      if (it != copies.end()) {
+        e = it->second.name.empty() ? make_int(it->second.value) : optimizer_detail::make_name(it->second.name);
+      }
+      return;
+    }
+    optimizer_detail::for_each_operand(*e, [&](expr_ptr_t& operand) {
+      replace_copies(operand, copies);
+    });
+  }
+
+  void rewrite(expr_ptr_t& e, const copies_t& copies) {
+    replace_copies(e, copies);
+    e->simplify(e);
+  }
+
+  static void kill(copies_t& copies, const std::string& name) {
+    copies.erase(name);
+    for (auto it = copies.begin(); it != copies.end();) {
+      it = it->second.name == name ? copies.erase(it) : std::next(it);
+    }
+  }
+
+  static void kill(copies_t& copies, const std::set<std::string>& names) {
+    for (const auto& name : names) {
+      kill(copies, name);
+    }
+  }
+
+  // Returns what is known after `nodes`
+  copies_t propagate_copies(std::vector<node_ptr_t>& nodes, copies_t copies) {
+    for (auto& node : nodes) {
+      if (auto assign = dynamic_cast<AssignNode*>(node.get())) {
+        rewrite(assign->value, copies);
+        const std::string* target = tracked_name(assign->target);
+        if (!target) {
+          if (!optimizer_detail::variable_name(assign->target)) {
+            rewrite(assign->target, copies);
+          }
+          continue;
+        }
+        kill(copies, *target);
+        int32_t value = 0;
+        const std::string* source = tracked_name(assign->value);
+        if (assign->value->get_constant(value)) {
+          copies[*target] = Copy{"", value};
+        } else if (source && *source != *target) {
+          copies[*target] = Copy{*source, 0};
+        }
+      } else if (auto exec = dynamic_cast<ExecNode*>(node.get())) {
+        rewrite(exec->expr, copies);
+      } else if (auto return_node = dynamic_cast<ReturnNode*>(node.get())) {
+        if (return_node->value) {
+          rewrite(return_node->value, copies);
+        }
+      } else if (auto if_node = dynamic_cast<IfNode*>(node.get())) {
+        rewrite(if_node->condition, copies);
+        copies_t then_copies = propagate_copies(if_node->body, copies);
+        copies_t else_copies = propagate_copies(if_node->else_body, copies);
+        copies.clear();
+        for (const auto& copy : then_copies) {
+          auto it = else_copies.find(copy.first);
+          if (it != else_copies.end() && it->second == copy.second) {
+            copies.insert(copy);
+          }
+        }
+      } else if (auto while_node = dynamic_cast<WhileNode*>(node.get())) {
+        std::set<std::string> assigned;
+        collect_assigned(while_node->body, assigned);
+        kill(copies, assigned);
+        rewrite(while_node->condition, copies);
+        propagate_copies(while_node->body, copies);
+      } else if (auto for_node = dynamic_cast<ForNode*>(node.get())) {
+        rewrite(for_node->num_start, copies);
+        std::set<std::string> assigned;
+        collect_assigned(for_node->body, assigned);
+        if (const std::string* var = optimizer_detail::variable_name(for_node->var)) {
+          assigned.insert(*var);
+        }
+        kill(copies, assigned);
+        if (!optimizer_detail::variable_name(for_node->var)) {
+          rewrite(for_node->var, copies);
+        }
+        rewrite(for_node->num_end, copies);
+        rewrite(for_node->num_step, copies);
+        propagate_copies(for_node->body, copies);
+      }
+    }
+    return copies;
+  }
+
+
+  // Dead code
+
+  // Drops statements that cannot run, and branches and loops decided by a constant
+  void prune(std::vector<node_ptr_t>& nodes) {
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      ASTNode* node = nodes[i].get();
+      int32_t value = 0;
+      if (dynamic_cast<ReturnNode*>(node) || dynamic_cast<BreakNode*>(node) || dynamic_cast<ContinueNode*>(node)) {
+        nodes.resize(i + 1);
+        return;
+      }
+      if (auto if_node = dynamic_cast<IfNode*>(node)) {
+        prune(if_node->body);
+        prune(if_node->else_body);
+        if (if_node->condition->get_constant(value)) {
+          std::vector<node_ptr_t> taken = std::move(value ? if_node->body : if_node->else_body);
+          nodes.erase(nodes.begin() + static_cast<ptrdiff_t>(i));
+          nodes.insert(nodes.begin() + static_cast<ptrdiff_t>(i), std::make_move_iterator(taken.begin()),
+                       std::make_move_iterator(taken.end()));
+          --i;
+        }
+      } else if (auto while_node = dynamic_cast<WhileNode*>(node)) {
+        prune(while_node->body);
+        if (while_node->condition->get_constant(value) && !value) {
+          nodes.erase(nodes.begin() + static_cast<ptrdiff_t>(i--));
+        }
+      } else if (auto for_node = dynamic_cast<ForNode*>(node)) {
+        prune(for_node->body);
+        if (for_node->num_end->get_constant(value) && !value) {
+          auto assign = std::make_unique<AssignNode>();
+          assign->target = std::move(for_node->var);
+          assign->value = std::move(for_node->num_start);
+          nodes[i] = std::move(assign);
+        }
+      }
+    }
+  }
+
+  void remove_dead_code(std::vector<node_ptr_t>& nodes) {
+    live_before(nodes, live_t{}, nullptr, true);
+  }
+
+  static void add_variables(live_t& live, const expr_ptr_t& e) {
+    for (const auto& name : optimizer_detail::variables(*e)) {
+      live.insert(name);
+    }
+  }
+
+  static live_t joined(live_t a, const live_t& b) {
+    a.insert(b.begin(), b.end());
+    return a;
+  }
+
+  // Variables read before being written, from the start of `nodes`, given those live after them. With
+  // `remove`, assignments to variables nobody reads and computations whose value is unused are dropped.
+  live_t live_before(std::vector<node_ptr_t>& nodes, live_t live, const LoopLive* loop, bool remove) {
+    for (size_t i = nodes.size(); i > 0; --i) {
+      ASTNode* node = nodes[i - 1].get();
+      if (auto assign = dynamic_cast<AssignNode*>(node)) {
+        const std::string* target = tracked_name(assign->target);
+        if (!target) {
+          add_variables(live, assign->target);
+          add_variables(live, assign->value);
+        } else if (live.count(*target)) {
+          live.erase(*target);
+          add_variables(live, assign->value);
+        } else if (assign->value->is_pure()) {
+          if (remove) {
+            nodes.erase(nodes.begin() + static_cast<ptrdiff_t>(i - 1));
+          }
+        } else {
+          add_variables(live, assign->value);
+          if (remove) {
+            auto exec = std::make_unique<ExecNode>();
+            exec->expr = std::move(assign->value);
+            nodes[i - 1] = std::move(exec);
+          }
+        }
+      } else if (auto exec = dynamic_cast<ExecNode*>(node)) {
+        if (exec->expr->is_pure()) {
+          if (remove) {
+            nodes.erase(nodes.begin() + static_cast<ptrdiff_t>(i - 1));
+          }
+        } else {
+          add_variables(live, exec->expr);
+        }
+      } else if (auto return_node = dynamic_cast<ReturnNode*>(node)) {
+        live.clear();
+        if (return_node->value) {
+          add_variables(live, return_node->value);
+        }
+      } else if (dynamic_cast<BreakNode*>(node)) {
+        live = loop ? loop->exit : live_t{};
+      } else if (dynamic_cast<ContinueNode*>(node)) {
+        live = loop ? loop->next : live_t{};
+      } else if (auto if_node = dynamic_cast<IfNode*>(node)) {
+        live = joined(live_before(if_node->body, live, loop, remove),
+                      live_before(if_node->else_body, live, loop, remove));
+        add_variables(live, if_node->condition);
+      } else if (auto while_node = dynamic_cast<WhileNode*>(node)) {
+        live_t head = live;
+        add_variables(head, while_node->condition);
+        while (true) {
+          LoopLive body_loop{live, head};
+          live_t next = joined(head, live_before(while_node->body, head, &body_loop, false));
+          if (next == head) {
+            break;
+          }
+          head = next;
+        }
+        if (remove) {
+          LoopLive body_loop{live, head};
+          live_before(while_node->body, head, &body_loop, true);
+        }
+        live = head;
+      } else if (auto for_node = dynamic_cast<ForNode*>(node)) {
+        // The step is added to the variable and the condition tested again
+        const std::string* var = tracked_name(for_node->var);
+        live_t head = live;
+        add_variables(head, for_node->num_end);
+        live_t step;
+        while (true) {
+          step = head;
+          add_variables(step, for_node->num_step);
+          add_variables(step, for_node->var);
+          LoopLive body_loop{live, step};
+          live_t next = joined(head, live_before(for_node->body, step, &body_loop, false));
+          if (next == head) {
+            break;
+          }
+          head = next;
+        }
+        if (remove) {
+          LoopLive body_loop{live, step};
+          live_before(for_node->body, step, &body_loop, true);
+        }
+        live = head;
+        if (var) {
+          live.erase(*var);
+        } else {
+          add_variables(live, for_node->var);
+        }
+        add_variables(live, for_node->num_start);
+      }
+    }
+    return live;
+  }
+
+
+  // Short-circuit evaluation
+
+  // `|` and `&` of truth values become OR and AND, which skip the right operand when the left one decides.
+  // The right operand is computed before the left one by `|` and `&`, so it must not be changed by it.
+  void short_circuit(expr_ptr_t& e) {
+    optimizer_detail::for_each_operand(*e, [&](expr_ptr_t& operand) {
+      short_circuit(operand);
+    });
+    auto bin = dynamic_cast<BinExpression*>(e.get());
+    if (!bin || (bin->op != '&' && bin->op != '|') || !bin->left->is_truth_value() ||
+        !bin->right->is_truth_value() || !is_unaffected(bin->right)) {
+      return;
+    }
+    auto logical = std::make_unique<LogicalExpression>();
+    logical->op = bin->op;
+    logical->left = std::move(bin->left);
+    logical->right = std::move(bin->right);
+    e = std::move(logical);
+  }
+
+
+  // Loop-invariant code motion
+
+  void hoist_expressions(expr_ptr_t& e, const std::set<std::string>& assigned, std::map<std::string, std::string>& hoisted,
+                         std::vector<node_ptr_t>& computed) {
+    if (is_candidate(e)) {
+      bool invariant = true;
+      for (const auto& name : optimizer_detail::variables(*e)) {
+        invariant = invariant && !assigned.count(name);
+      }
+      if (invariant) {
+        std::string key = optimizer_detail::key_of(*e);
+        auto it = hoisted.find(key);
+        if (it == hoisted.end()) {
+          it = hoisted.emplace(key, new_temp("licm")).first;
+          auto assign = std::make_unique<AssignNode>();
+          assign->target = optimizer_detail::make_name(it->second);
+          assign->value = std::move(e);
+          computed.push_back(std::move(assign));
+        }
+        e = optimizer_detail::make_name(it->second);
+        return;
+      }
+    }
+    optimizer_detail::for_each_operand(*e, [&](expr_ptr_t& operand) {
+      hoist_expressions(operand, assigned, hoisted, computed);
+    });
+  }
+
+  // Calls `f` on every expression computed by `nodes` and the statements inside them
+  static void for_each_expression(std::vector<node_ptr_t>& nodes, const std::function<void(expr_ptr_t&)>& f) {
+    for (auto& node : nodes) {
+      if (auto assign = dynamic_cast<AssignNode*>(node.get())) {
+        f(assign->value);
+        if (!optimizer_detail::variable_name(assign->target)) {
+          f(assign->target);
+        }
+      } else if (auto exec = dynamic_cast<ExecNode*>(node.get())) {
+        f(exec->expr);
+      } else if (auto return_node = dynamic_cast<ReturnNode*>(node.get())) {
+        if (return_node->value) {
+          f(return_node->value);
+        }
+      } else if (auto if_node = dynamic_cast<IfNode*>(node.get())) {
+        f(if_node->condition);
+        for_each_expression(if_node->body, f);
+        for_each_expression(if_node->else_body, f);
+      } else if (auto while_node = dynamic_cast<WhileNode*>(node.get())) {
+        f(while_node->condition);
+        for_each_expression(while_node->body, f);
+      } else if (auto for_node = dynamic_cast<ForNode*>(node.get())) {
+        if (!optimizer_detail::variable_name(for_node->var)) {
+          f(for_node->var);
+        }
+        f(for_node->num_start);
+        f(for_node->num_end);
+        f(for_node->num_step);
+        for_each_expression(for_node->body, f);
+      }
+    }
+  }
+
+  // Pure expressions inside a loop whose variables the loop never assigns are computed once before it.
+  // They cannot fail, so computing them for a loop that runs zero times is harmless.
+  void hoist_invariants(std::vector<node_ptr_t>& nodes) {
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      ASTNode* node = nodes[i].get();
+      std::vector<node_ptr_t> computed;
+      std::map<std::string, std::string> hoisted;
+      std::set<std::string> assigned;
+      auto hoist = [&](expr_ptr_t& e) {
+        hoist_expressions(e, assigned, hoisted, computed);
+      };
+      if (auto if_node = dynamic_cast<IfNode*>(node)) {
+        hoist_invariants(if_node->body);
+        hoist_invariants(if_node->else_body);
+      } else if (auto while_node = dynamic_cast<WhileNode*>(node)) {
+        collect_assigned(while_node->body, assigned);
+        hoist(while_node->condition);
+        for_each_expression(while_node->body, hoist);
+        hoist_invariants(while_node->body);
+      } else if (auto for_node = dynamic_cast<ForNode*>(node)) {
+        collect_assigned(for_node->body, assigned);
+        if (const std::string* var = optimizer_detail::variable_name(for_node->var)) {
+          assigned.insert(*var);
+        } else {
+          hoist(for_node->var);
+        }
+        hoist(for_node->num_end);
+        hoist(for_node->num_step);
+        for_each_expression(for_node->body, hoist);
+        hoist_invariants(for_node->body);
+      }
+      nodes.insert(nodes.begin() + static_cast<ptrdiff_t>(i), std::make_move_iterator(computed.begin()),
+                   std::make_move_iterator(computed.end()));
+      i += computed.size();
+    }
+  }
+
+
+  // Common subexpressions
+
+  // Computes the expression of `entry` into a new variable just before the statement it was first seen in
+  void materialize(Available& entry) {
+    entry.temp = new_temp("cse");
+    auto assign = std::make_unique<AssignNode>();
+    assign->target = optimizer_detail::make_name(entry.temp);
+    assign->value = std::move(*entry.slot);
+    *entry.slot = optimizer_detail::make_name(entry.temp);
+    const ASTNode* inserted = assign.get();
+    auto position = std::find_if(entry.list->begin(), entry.list->end(), [&](const node_ptr_t& node) {
+      return node.get() == entry.statement;
+    });
+    entry.list->insert(position, std::move(assign));
+    // Expressions seen first in the same statement may now be inside the new one, which runs before it
+    const ASTNode* statement = entry.statement;
+    for (auto& other : entries) {
+      if (other.temp.empty() && other.statement == statement) {
+        other.statement = inserted;
+      }
+    }
+  }
+
+  // Replaces expressions computed before with their variable. With a `list`, the expressions seen here
+  // are remembered, as computed by `statement` of that list.
+  void reuse(expr_ptr_t& e, available_t& available, std::vector<node_ptr_t>* list, const ASTNode* statement) {
+    if (is_candidate(e)) {
+      std::string key = optimizer_detail::key_of(*e);
+      auto it = available.find(key);
+      if (it != available.end()) {
+        if (it->second->temp.empty()) {
+          materialize(*it->second);
+        }
+        e = optimizer_detail::make_name(it->second->temp);
+        return;
+      }
+      if (list) {
+        entries.push_back(Available{&e, list, statement, optimizer_detail::variables(*e), ""});
+        available[key] = &entries.back();
+      }
+    }
+    optimizer_detail::for_each_operand(*e, [&](expr_ptr_t& operand) {
+      reuse(operand, available, list, statement);
+    });
+  }
+
+  static void kill(available_t& available, const std::set<std::string>& names) {
+    for (auto it = available.begin(); it != available.end();) {
+      bool killed = false;
+      for (const auto& name : names) {
+        killed = killed || it->second->variables.count(name);
+      }
+      it = killed ? available.erase(it) : std::next(it);
+    }
+  }
+
+  // Expressions computed in a branch or a loop body are not available after it
+  void eliminate_common_subexpressions(std::vector<node_ptr_t>& nodes, available_t& available) {
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      ASTNode* node = nodes[i].get();
+      auto visit = [&](expr_ptr_t& e) {
+        reuse(e, available, &nodes, node);
+      };
+      auto look_up = [&](expr_ptr_t& e) {
+        reuse(e, available, nullptr, node);
+      };
+      std::set<std::string> assigned;
+      if (auto assign = dynamic_cast<AssignNode*>(node)) {
+        visit(assign->value);
+        if (const std::string* target = optimizer_detail::variable_name(assign->target)) {
+          assigned.insert(*target);
+        } else {
+          visit(assign->target);
+        }
+      } else if (auto exec = dynamic_cast<ExecNode*>(node)) {
+        visit(exec->expr);
+      } else if (auto return_node = dynamic_cast<ReturnNode*>(node)) {
+        if (return_node->value) {
+          visit(return_node->value);
+        }
+      } else if (auto if_node = dynamic_cast<IfNode*>(node)) {
+        visit(if_node->condition);
+        available_t then_available = available;
+        eliminate_common_subexpressions(if_node->body, then_available);
+        available_t else_available = available;
+        eliminate_common_subexpressions(if_node->else_body, else_available);
+        collect_assigned(if_node->body, assigned);
+        collect_assigned(if_node->else_body, assigned);
+      } else if (auto while_node = dynamic_cast<WhileNode*>(node)) {
+        collect_assigned(while_node->body, assigned);
+        kill(available, assigned);
+        look_up(while_node->condition);
+        available_t body_available = available;
+        eliminate_common_subexpressions(while_node->body, body_available);
+      } else if (auto for_node = dynamic_cast<ForNode*>(node)) {
+        visit(for_node->num_start);
+        collect_assigned(for_node->body, assigned);
+        if (const std::string* var = optimizer_detail::variable_name(for_node->var)) {
+          assigned.insert(*var);
+        }
+        kill(available, assigned);
+        if (!optimizer_detail::variable_name(for_node->var)) {
+          look_up(for_node->var);
+        }
+        look_up(for_node->num_end);
+        look_up(for_node->num_step);
+        available_t body_available = available;
+        eliminate_common_subexpressions(for_node->body, body_available);
+      }
+      kill(available, assigned);
+      // New variables may have been computed before this statement
+      while (nodes[i].get() != node) {
+        ++i;
+      }
+    }
+  }
+
+  Function& function;
+  std::set<std::string> untracked{};
+  size_t temp_count{0};
+  std::list<Available> entries{};
+};
+
+
+void optimize(Function& function) {
+  FunctionOptimizer(function).run();
+}
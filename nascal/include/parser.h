@@ -3,6 +3,7 @@
 #include "ast.h"
 
 expr_ptr_t parse_expr(Tokenizer& tokenizer, Function& function);
+void parse_statement(Tokenizer& tokenizer, Function& function, std::vector<node_ptr_t>& nodes);
 
 
 expr_ptr_t parse_expratom(Tokenizer& tokenizer, Function& function) {
@@ -76,7 +77,7 @@ expr_ptr_t parse_expradd(Tokenizer& tokenizer, Function& function) {
   return expr;
 }
 
-expr_ptr_t parse_expr(Tokenizer& tokenizer, Function& function) {
+expr_ptr_t parse_exprcmp(Tokenizer& tokenizer, Function& function) {
   expr_ptr_t expr = parse_expradd(tokenizer, function);
   if (tokenizer.peek_token().type != token_type_t::CMP_OP) {
     return expr;
@@ -88,6 +89,32 @@ expr_ptr_t parse_expr(Tokenizer& tokenizer, Function& function) {
   return cmp;
 }
 
+expr_ptr_t parse_exprand(Tokenizer& tokenizer, Function& function) {
+  expr_ptr_t expr = parse_exprcmp(tokenizer, function);
+  while (tokenizer.peek_token().type == token_type_t::AND) {
+    tokenizer.get_token();
+    auto logical = std::make_unique<LogicalExpression>();
+    logical->left = std::move(expr);
+    logical->op = '&';
+    logical->right = parse_exprcmp(tokenizer, function);
+    expr = std::move(logical);
+  }
+  return expr;
+}
+
+expr_ptr_t parse_expr(Tokenizer& tokenizer, Function& function) {
+  expr_ptr_t expr = parse_exprand(tokenizer, function);
+  while (tokenizer.peek_token().type == token_type_t::OR) {
+    tokenizer.get_token();
+    auto logical = std::make_unique<LogicalExpression>();
+    logical->left = std::move(expr);
+    logical->op = '|';
+    logical->right = parse_exprand(tokenizer, function);
+    expr = std::move(logical);
+  }
+  return expr;
+}
+
 node_ptr_t parse_op(Tokenizer& tokenizer, Function& function) {
 
   if (tokenizer.peek_token().type == token_type_t::WHILE) {
@@ -101,7 +128,7 @@ node_ptr_t parse_op(Tokenizer& tokenizer, Function& function) {
       if (tokenizer.peek_token().type == token_type_t::NONE) {
         throw parse_error("Unexpected end of while");
       }
-      node->body.push_back(parse_op(tokenizer, function));
+      parse_statement(tokenizer, function, node->body);
     }
     tokenizer.get_token();
     if (tokenizer.get_token().type != token_type_t::SEMICOLON) {
@@ -149,7 +176,7 @@ node_ptr_t parse_op(Tokenizer& tokenizer, Function& function) {
       if (tokenizer.peek_token().type == token_type_t::NONE) {
         throw parse_error("Unexpected end of for");
       }
-      node->body.push_back(parse_op(tokenizer, function));
+      parse_statement(tokenizer, function, node->body);
     }
     tokenizer.get_token();
     if (tokenizer.get_token().type != token_type_t::SEMICOLON) {
@@ -170,14 +197,14 @@ node_ptr_t parse_op(Tokenizer& tokenizer, Function& function) {
       if (tokenizer.peek_token().type == token_type_t::NONE) {
         throw parse_error("Unexpected end of if");
       }
-      node->body.push_back(parse_op(tokenizer, function));
+      parse_statement(tokenizer, function, node->body);
     }
     if (tokenizer.get_token().type == token_type_t::ELSE) {
       while (tokenizer.peek_token().type != token_type_t::END) {
         if (tokenizer.peek_token().type == token_type_t::NONE) {
           throw parse_error("Unexpected end of else");
         }
-        node->else_body.push_back(parse_op(tokenizer, function));
+        parse_statement(tokenizer, function, node->else_body);
       }
       tokenizer.get_token();
     }
@@ -237,6 +264,111 @@ node_ptr_t parse_op(Tokenizer& tokenizer, Function& function) {
 }
 
 
+// SWITCH value DO CASE constant, ... THEN statements ... ELSE statements END; runs the statements of the
+// CASE listing the value, or those of ELSE if none does. It is a chain of IFs comparing a variable with the
+// constants, which is compiled as a jump table; a value that is not a variable is computed into one first.
+void parse_switch(Tokenizer& tokenizer, Function& function, std::vector<node_ptr_t>& nodes) {
+  tokenizer.get_token();
+  auto value = parse_expr(tokenizer, function);
+  if (tokenizer.get_token().type != token_type_t::DO) {
+    throw parse_error("DO expected");
+  }
+  std::string name;
+  if (auto ne = dynamic_cast<const NameExpression*>(value.get())) {
+    name = ne->name;
+  } else {
+    // No name in the source has a dot, and the number of locals grows with every one added
+    name = "switch." + std::to_string(function.locals.size());
+    function.locals.insert(name);
+    auto target = std::make_unique<NameExpression>();
+    target->name = name;
+    auto assign = std::make_unique<AssignNode>();
+    assign->target = std::move(target);
+    assign->value = std::move(value);
+    nodes.push_back(std::move(assign));
+  }
+  std::vector<std::unique_ptr<IfNode>> cases;
+  std::set<int32_t> seen;
+  while (tokenizer.peek_token().type == token_type_t::CASE) {
+    tokenizer.get_token();
+    auto node = std::make_unique<IfNode>();
+    while (true) {
+      auto constant = parse_expr(tokenizer, function);
+      constant->simplify(constant);
+      int32_t k = 0;
+      if (!constant->get_constant(k)) {
+        throw parse_error("Constant expected");
+      }
+      if (!seen.insert(k).second) {
+        throw parse_error("Duplicate case");
+      }
+      auto ne = std::make_unique<NameExpression>();
+      ne->name = name;
+      auto cmp = std::make_unique<BinExpression>();
+      cmp->left = std::move(ne);
+      cmp->op = '=';
+      cmp->right = std::move(constant);
+      if (node->condition) {
+        auto logical = std::make_unique<LogicalExpression>();
+        logical->left = std::move(node->condition);
+        logical->op = '|';
+        logical->right = std::move(cmp);
+        node->condition = std::move(logical);
+      } else {
+        node->condition = std::move(cmp);
+      }
+      if (tokenizer.peek_token().type != token_type_t::COMMA) {
+        break;
+      }
+      tokenizer.get_token();
+    }
+    if (tokenizer.get_token().type != token_type_t::THEN) {
+      throw parse_error("THEN expected");
+    }
+    while (tokenizer.peek_token().type != token_type_t::END && tokenizer.peek_token().type != token_type_t::CASE &&
+           tokenizer.peek_token().type != token_type_t::ELSE) {
+      if (tokenizer.peek_token().type == token_type_t::NONE) {
+        throw parse_error("Unexpected end of case");
+      }
+      parse_statement(tokenizer, function, node->body);
+    }
+    cases.push_back(std::move(node));
+  }
+  if (cases.empty()) {
+    throw parse_error("CASE expected");
+  }
+  // Each CASE is in the ELSE of the one before it, and the last one has the ELSE of the switch
+  std::vector<node_ptr_t> else_body;
+  if (tokenizer.get_token().type == token_type_t::ELSE) {
+    while (tokenizer.peek_token().type != token_type_t::END) {
+      if (tokenizer.peek_token().type == token_type_t::NONE) {
+        throw parse_error("Unexpected end of else");
+      }
+      parse_statement(tokenizer, function, else_body);
+    }
+    tokenizer.get_token();
+  }
+  if (tokenizer.get_token().type != token_type_t::SEMICOLON) {
+    throw parse_error("Missing ;");
+  }
+  for (size_t i = cases.size() - 1; i > 0; --i) {
+    cases[i]->else_body = std::move(else_body);
+    else_body.clear();
+    else_body.push_back(std::move(cases[i]));
+  }
+  cases.front()->else_body = std::move(else_body);
+  nodes.push_back(std::move(cases.front()));
+}
+
+// A statement is one node, except a SWITCH that computes its value first
+void parse_statement(Tokenizer& tokenizer, Function& function, std::vector<node_ptr_t>& nodes) {
+  if (tokenizer.peek_token().type == token_type_t::SWITCH) {
+    parse_switch(tokenizer, function, nodes);
+    return;
+  }
+  nodes.push_back(parse_op(tokenizer, function));
+}
+
 Function parse_def(Tokenizer& tokenizer) {
   Function func;
   if (tokenizer.get_token().type != token_type_t::DEF) {
@@ -265,7 +397,7 @@ Function parse_def(Tokenizer& tokenizer) {
     if (tokenizer.peek_token().type == token_type_t::NONE) {
       throw parse_error("Unexpected end of function");
     }
-    func.body.push_back(parse_op(tokenizer, func));
+    parse_statement(tokenizer, func, func.body);
   }
   tokenizer.get_token();
   if (tokenizer.get_token().type != token_type_t::SEMICOLON) {
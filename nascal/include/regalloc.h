@@ -0,0 +1,161 @@
+#pragma once
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Register use of compiled code: R0 carries call results and scratch values, R1-R9 belong to single
+// statements, expression temporaries are taken from R10-R49 and variables are kept in R50-R249.
+// A call may change R0-R99: temporaries are saved by the caller around it, and only variables that are not
+// needed after any call are kept in R50-R99. Variables in R100-R249 are saved by the callee that uses them.
+// The first arguments of a call are passed in R50-R57.
+
+constexpr uint8_t SPILL_REG = 6;
+constexpr uint8_t FIRST_TEMP_REG = 10;
+constexpr uint8_t LAST_TEMP_REG = 49;
+constexpr uint8_t FIRST_CALLER_SAVED_REG = 50;
+constexpr uint8_t LAST_CALLER_SAVED_REG = 99;
+constexpr uint8_t FIRST_ARG_REG = 50;
+constexpr size_t ARG_REG_COUNT = 8;
+constexpr uint8_t FIRST_CALLEE_SAVED_REG = 100;
+constexpr uint8_t LAST_CALLEE_SAVED_REG = 249;
+
+
+// Where the variables of a function are mentioned, numbered in the order their code reads them.
+// Position 0 is the prologue, where the parameters arrive.
+struct VariableUsage {
+  std::map<std::string, std::pair<size_t, size_t>> intervals{};
+  // A variable mentioned inside a loop is live through all of it
+  std::vector<std::pair<size_t, size_t>> loops{};
+  std::set<std::string> address_taken{};
+  // Positions of calls: a variable mentioned both before and at or after one must survive it
+  std::vector<size_t> calls{};
+  size_t position{1};
+
+  void mention(const std::string& name) {
+    auto it = intervals.find(name);
+    if (it == intervals.end()) {
+      intervals[name] = {position, position};
+    } else {
+      it->second.second = position;
+    }
+    ++position;
+  }
+
+  // Keeps a variable mentioned before in its register up to here. An operand read directly from its
+  // register after other operands are computed must not share it with a variable they write.
+  void extend(const std::string& name) {
+    auto it = intervals.find(name);
+    if (it != intervals.end()) {
+      it->second.second = position;
+    }
+    ++position;
+  }
+
+  void leave_loop(size_t start) {
+    loops.emplace_back(start, position);
+  }
+
+  void call() {
+    calls.push_back(position);
+  }
+};
+
+struct RegisterAllocation {
+  std::map<std::string, uint8_t> registers{};
+  // Callee-saved registers the function overwrites, in increasing order
+  std::vector<uint8_t> used{};
+};
+
+
+// Linear scan: intervals are taken in order of their start. An interval no call falls into gets a caller-saved
+// register, the argument register of a parameter passed in one if possible, and the others get the lowest free
+// callee-saved register. When none fits, the interval ending last stays in memory.
+// `passed` are the parameters arriving in the argument registers, in order.
+RegisterAllocation allocate_registers(const VariableUsage& usage, const std::vector<std::string>& params,
+                                      const std::vector<std::string>& passed) {
+  struct Interval {
+    std::string name;
+    size_t start, end;
+    bool survives_call;
+  };
+  std::vector<Interval> intervals;
+  for (const auto& v : usage.intervals) {
+    if (usage.address_taken.count(v.first)) {
+      continue;
+    }
+    Interval interval{v.first, v.second.first, v.second.second, false};
+    if (std::find(params.begin(), params.end(), v.first) != params.end()) {
+      interval.start = 0;
+    }
+    // Inner loops come first, so one pass also extends through the loops around them
+    for (const auto& loop : usage.loops) {
+      if (interval.start <= loop.second && interval.end >= loop.first) {
+        interval.start = std::min(interval.start, loop.first);
+        interval.end = std::max(interval.end, loop.second);
+      }
+    }
+    for (auto call : usage.calls) {
+      interval.survives_call = interval.survives_call || (interval.start < call && call <= interval.end);
+    }
+    intervals.push_back(interval);
+  }
+  std::stable_sort(intervals.begin(), intervals.end(), [](const Interval& a, const Interval& b) {
+    return a.start < b.start;
+  });
+
+  RegisterAllocation allocation;
+  std::set<uint8_t> free;
+  for (size_t reg = FIRST_CALLER_SAVED_REG; reg <= LAST_CALLEE_SAVED_REG; ++reg) {
+    free.insert(static_cast<uint8_t>(reg));
+  }
+  auto caller_saved = [](uint8_t reg) {
+    return reg <= LAST_CALLER_SAVED_REG;
+  };
+  std::set<std::pair<size_t, std::string>> active;
+  for (const auto& interval : intervals) {
+    while (!active.empty() && active.begin()->first < interval.start) {
+      free.insert(allocation.registers.at(active.begin()->second));
+      active.erase(active.begin());
+    }
+    auto it = free.lower_bound(FIRST_CALLEE_SAVED_REG);
+    if (!interval.survives_call) {
+      auto arg = std::find(passed.begin(), passed.end(), interval.name);
+      // Registers that may still be wanted by a parameter are taken last
+      auto other = free.lower_bound(static_cast<uint8_t>(FIRST_ARG_REG + ARG_REG_COUNT));
+      if (arg != passed.end() && free.count(static_cast<uint8_t>(FIRST_ARG_REG + (arg - passed.begin())))) {
+        it = free.find(static_cast<uint8_t>(FIRST_ARG_REG + (arg - passed.begin())));
+      } else if (other != free.end() && caller_saved(*other)) {
+        it = other;
+      } else if (free.begin() != free.end() && caller_saved(*free.begin())) {
+        it = free.begin();
+      }
+    }
+    if (it != free.end()) {
+      allocation.registers[interval.name] = *it;
+      free.erase(it);
+      active.emplace(interval.end, interval.name);
+      continue;
+    }
+    // The register of a variable surviving a call cannot be given to another one
+    for (auto last = active.rbegin(); last != active.rend() && last->first > interval.end; ++last) {
+      uint8_t reg = allocation.registers.at(last->second);
+      if (!interval.survives_call || !caller_saved(reg)) {
+        allocation.registers[interval.name] = reg;
+        allocation.registers.erase(last->second);
+        active.erase(std::next(last).base());
+        active.emplace(interval.end, interval.name);
+        break;
+      }
+    }
+  }
+  std::set<uint8_t> used;
+  for (const auto& r : allocation.registers) {
+    if (!caller_saved(r.second)) {
+      used.insert(r.second);
+    }
+  }
+  allocation.used.assign(used.begin(), used.end());
+  return allocation;
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <cstdint>
+#include <limits>
+
+// Arithmetic of the VM on constants, for simplifying expressions at compile time
+
+// Not a source operator: shifts the left operand left by the right one, or logically right if it is negative
+constexpr char SHIFT_OP = 'S';
+
+// Computes `a op b` as the VM would. Returns false when the VM would stop with an error instead.
+bool fold_binary(char op, int32_t a, int32_t b, int32_t& result) {
+  auto ua = static_cast<uint32_t>(a);
+  auto ub = static_cast<uint32_t>(b);
+  switch (op) {
+    case '+':
+      result = static_cast<int32_t>(ua + ub);
+      return true;
+    case '-':
+      result = static_cast<int32_t>(ua - ub);
+      return true;
+    case '*':
+      result = static_cast<int32_t>(ua * ub);
+      return true;
+    case '/':
+    case '%':
+      if (b == 0 || (a == std::numeric_limits<int32_t>::min() && b == -1)) {
+        return false;
+      }
+      result = op == '/' ? a / b : a % b;
+      return true;
+    case '&':
+      result = a & b;
+      return true;
+    case '|':
+      result = a | b;
+      return true;
+    case '^':
+      result = a ^ b;
+      return true;
+    // Comparisons test the sign of the difference, like the code generated for them
+    case '=':
+      result = a == b;
+      return true;
+    case '<':
+      result = static_cast<int32_t>(ua - ub) < 0;
+      return true;
+    case '>':
+      result = static_cast<int32_t>(ub - ua) < 0;
+      return true;
+    case SHIFT_OP:
+      if (b <= -32 || b >= 32) {
+        return false;
+      }
+      result = static_cast<int32_t>(b >= 0 ? ua << b : ua >> -b);
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool fold_unary(char op, int32_t a, int32_t& result) {
+  switch (op) {
+    case '-':
+      result = static_cast<int32_t>(0u - static_cast<uint32_t>(a));
+      return true;
+    case '~':
+      result = ~a;
+      return true;
+    case '!':
+      result = a == 0;
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool is_commutative(char op) {
+  return op == '+' || op == '*' || op == '&' || op == '|' || op == '^' || op == '=';
+}
+
+// k if value is 2 to the power of k, -1 otherwise
+int power_of_two(int32_t value) {
+  if (value <= 0 || (value & (value - 1))) {
+    return -1;
+  }
+  int k = 0;
+  while (value >>= 1) {
+    ++k;
+  }
+  return k;
+}
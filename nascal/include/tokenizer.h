@@ -5,7 +5,7 @@
 
 enum class token_type_t {
   NONE, INT, UNARY_OP, ADD_OP, MUL_OP, CMP_OP, SEMICOLON, NAME, LEFT_PAR, RIGHT_PAR, COMMA, ASSIGN,
-  END, RETURN, DEF, IF, THEN, ELSE, WHILE, DO, BREAK, CONTINUE, FOR
+  END, RETURN, DEF, IF, THEN, ELSE, WHILE, DO, BREAK, CONTINUE, FOR, AND, OR, SWITCH, CASE
 };
 
 struct Token {
@@ -143,6 +143,14 @@ class Tokenizer {
         t.type = token_type_t::CONTINUE;
       } else if (t.value == "FOR") {
         t.type = token_type_t::FOR;
+      } else if (t.value == "AND") {
+        t.type = token_type_t::AND;
+      } else if (t.value == "OR") {
+        t.type = token_type_t::OR;
+      } else if (t.value == "SWITCH") {
+        t.type = token_type_t::SWITCH;
+      } else if (t.value == "CASE") {
+        t.type = token_type_t::CASE;
       } else {
         expecting_binary_op = true;
         t.type = token_type_t::NAME;
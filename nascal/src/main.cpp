@@ -1,14 +1,70 @@
 #include <iostream>
 #include <fstream>
 #include "parser.h"
+#include "inliner.h"
+#include "optimizer.h"
 
 
+const std::set<std::pair<std::string, size_t>> runtime_functions = {{"printchar", 1},
+                                                                    {"readchar",  0}};
+
+void emit_runtime(CompilationContext& context, bool exported) {
+  if (exported) {
+    context.code.global("@func_printchar_1");
+    context.code.global("@func_readchar_0");
+  }
+  context.code.label("@func_printchar_1");
+  context.code.emit_value("set", 0, 4);
+  context.code.emit("add", 0, REG_STACK);
+  context.code.emit("load32", 0, 0);
+  context.code.emit("out", 0);
+  context.code.emit("ret");
+  context.code.label("@func_readchar_0");
+  context.code.emit("in", 0);
+  context.code.emit("ret");
+}
+
+// Modules are written as object files, programs as images, or either as assembly text
+void print_code(const CompilationContext& context, bool assembly, bool module) {
+  if (assembly) {
+    write_assembly(context.code.get_lines(), std::cout);
+    return;
+  }
+  auto bytes = module ? encode_object(context.code.get_lines()) : encode_image(context.code.get_lines());
+  std::cout.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+}
+
 int main(int argc, char** argv) {
-  if (argc <= 1) {
+  // --module: compile a separately linked module (no runtime, functions exported, calls may be external)
+  // --runtime: print only the runtime as a module
+  // -S: print assembly instead of the binary
+  const char* filename = nullptr;
+  bool module = false;
+  bool runtime = false;
+  bool assembly = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--module") {
+      module = true;
+    } else if (arg == "--runtime") {
+      runtime = true;
+    } else if (arg == "-S") {
+      assembly = true;
+    } else {
+      filename = argv[i];
+    }
+  }
+  if (runtime) {
+    CompilationContext context{};
+    emit_runtime(context, true);
+    print_code(context, assembly, true);
+    return 0;
+  }
+  if (!filename) {
     std::cerr << "Filename required" << std::endl;
     return 1;
   }
-  std::ifstream infile(argv[1]);
+  std::ifstream infile(filename);
   if (!infile.is_open()) {
     std::cerr << "Error: no such file" << std::endl;
     return 1;
@@ -23,14 +79,22 @@ int main(int argc, char** argv) {
               "Line " << tokenizer.get_line() << ", position " << tokenizer.get_linepos() << std::endl;
     return 1;
   }
-  std::set<std::pair<std::string, size_t>> func_names = {{"printchar", 1},
-                                                         {"readchar",  0}};
+  std::set<std::pair<std::string, size_t>> func_names = runtime_functions;
+  for (const auto& b : builtin_functions) {
+    func_names.insert(b.first);
+  }
   for (const auto& f : functions) {
+    if (builtin_functions.count({f.name, f.params.size()})) {
+      std::cerr << "COMPILE ERROR\n" << "Function " << f.name << " with " << f.params.size() <<
+                (f.params.size() == 1 ? " argument" : " arguments") << " is builtin and cannot be defined"
+                << std::endl;
+      return 1;
+    }
     func_names.insert({f.name, f.params.size()});
   }
   for (const auto& f : functions) {
     for (const auto& name : f.called) {
-      if (!func_names.count(name)) {
+      if (!module && !func_names.count(name)) {
         std::cerr << "COMPILE ERROR\n" << "Function " << f.name <<
                   " calls function " << name.first << " with " << name.second <<
                   (name.second == 1 ? " argument" : " arguments")
@@ -40,35 +104,62 @@ int main(int argc, char** argv) {
     }
   }
 
-  if (!func_names.count({"main", 0})) {
+  bool has_main = func_names.count({"main", 0});
+  if (!module && !has_main) {
     std::cerr << "COMPILE ERROR\nFunction main with no arguments does not exist" << std::endl;
     return 0;
   }
 
   CompilationContext context{};
-  context.code.emplace_back("call @func_main_0");
-  context.code.emplace_back("jmp @end");
-  context.code.emplace_back("@func_printchar_1");
-  context.code.emplace_back("set R0 4");
-  context.code.emplace_back("add R0 RS");
-  context.code.emplace_back("load32 R0 R0");
-  context.code.emplace_back("out R0");
-  context.code.emplace_back("ret");
-  context.code.emplace_back("@func_readchar_0");
-  context.code.emplace_back("in R0");
-  context.code.emplace_back("ret");
-  for (const auto& f : functions) {
+  if (has_main) {
+    context.code.emit_jump("call", "@func_main_0");
+    context.code.emit_jump("jmp", module ? "@__image_end" : "@end");
+  }
+  if (module) {
+    for (const auto& f : functions) {
+      context.code.global("@func_" + f.name + "_" + std::to_string(f.params.size()));
+    }
+  } else {
+    emit_runtime(context, false);
+  }
+  try {
+    for (auto& f : functions) {
+      f.simplify();
+    }
+    inline_calls(functions);
+  } catch (const std::exception& e) {
+    std::cerr << "COMPILE ERROR\nInternal error: " << e.what() << std::endl;
+    return 1;
+  }
+  // Exported functions and those using the address of a parameter receive their arguments on the stack
+  if (!module) {
+    for (const auto& f : functions) {
+      if (!f.takes_parameter_address()) {
+        context.register_functions.insert({f.name, f.params.size()});
+      }
+    }
+  }
+  for (auto& f : functions) {
     try {
+      optimize(f);
       f.assemble(context);
     } catch (const compile_error& e) {
       std::cerr << "COMPILE ERROR\nFunction " << f.name << ": " << e.what() << std::endl;
       return 1;
+    } catch (const std::exception& e) {
+      std::cerr << "COMPILE ERROR\nFunction " << f.name << ": internal error: " << e.what() << std::endl;
+      return 1;
     }
   }
-  context.code.emplace_back("@end");
+  if (!module) {
+    context.code.label("@end");
+  }
 
-  for (const auto& s : context.code) {
-    std::cout << s << '\n';
+  try {
+    print_code(context, assembly, module);
+  } catch (const std::runtime_error& e) {
+    std::cerr << "COMPILE ERROR\n" << e.what() << std::endl;
+    return 1;
   }
   return 0;
-}
\ No newline at end of file
+}